@@ -0,0 +1,511 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./user_space_ai/mcts.h"
+#include "./user_space_ai/negamax.h"
+#include "./user_space_ai/rollout.h"
+#include "./user_space_ai/tablebase.h"
+#include "./user_space_ai/zobrist.h"
+#include "book.h"
+#include "game.h"
+
+/* Benchmarks for the user-space copies of the AI. Run "./bench" for all of
+ * them or "./bench <name>..." for a subset.
+ */
+
+#define BENCH_BUDGET_US 500000
+#define BENCH_ARENA_SIZE (1 << 22)
+#define BENCH_ROLLOUTS 2000000
+#define BENCH_STEP 1000
+#define BENCH_RAVE_STEP 250
+#define BENCH_SEEDS 8
+#define BENCH_NEGAMAX_RUNS 20
+#define BENCH_TT_OPS (1 << 20)
+#define BENCH_TB_PROBES (1 << 20)
+#define BENCH_BOOK_PROBES (1 << 20)
+#define BENCH_SMP_DEPTH 10
+#define BENCH_SMP_RUNS 5
+
+/* Positions as seen on the board, row by row, ' ' for an empty grid */
+static const char *positions[] = {
+    "                ",
+    "     O    X     ",
+    "O X  O  X   O  X",
+    "OX  XO     X O  ",
+};
+#define N_POSITIONS (sizeof(positions) / sizeof(positions[0]))
+
+static char load_position(const char *pos, board_t *board)
+{
+    int n = 0;
+    board_init(board);
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (pos[i] != ' ') {
+            board_play(board, i, pos[i]);
+            n++;
+        }
+    }
+    return (n & 1) ? 'X' : 'O';
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct tree_worker {
+    pthread_t thread;
+    struct mcts_info *obj;
+    struct state_array xoro;
+    int iterations;
+};
+
+static void *tree_worker_func(void *arg)
+{
+    struct tree_worker *w = arg;
+    w->iterations = mcts_worker(w->obj, &w->xoro, 0);
+    return NULL;
+}
+
+/* Playouts per second of one shared tree grown by 1, 2, 4 and 8 workers for
+ * BENCH_BUDGET_US on every position, against the serial search.
+ */
+static void bench_mcts_tree(void)
+{
+    static const int n_threads[] = {0, 1, 2, 4, 8};
+    struct tree_worker workers[8];
+    struct mcts_info obj;
+
+    printf("mcts-tree: %d us per search, %d positions\n", BENCH_BUDGET_US,
+           (int) N_POSITIONS);
+    for (size_t t = 0; t < sizeof(n_threads) / sizeof(n_threads[0]); t++) {
+        long long total = 0;
+        double elapsed = 0;
+        if (n_threads[t])
+            printf("  %d workers  moves:", n_threads[t]);
+        else
+            printf("  serial     moves:");
+        for (size_t p = 0; p < N_POSITIONS; p++) {
+            int visits[N_GRIDS];
+            board_t board;
+            char player = load_position(positions[p], &board);
+
+            /* A fresh tree per run, so no search starts from a reused one */
+            if (mcts_info_init(&obj, BENCH_ARENA_SIZE, 0) < 0)
+                exit(1);
+            double t0 = now_s();
+            if (!n_threads[t]) {
+                total += mcts_search(&obj, &board, player, BENCH_BUDGET_US,
+                                     visits);
+            } else {
+                mcts_begin(&obj, &board, player, BENCH_BUDGET_US);
+                for (int i = 0; i < n_threads[t]; i++) {
+                    workers[i].obj = &obj;
+                    xoro_init_stream(&workers[i].xoro, i);
+                    pthread_create(&workers[i].thread, NULL, tree_worker_func,
+                                   &workers[i]);
+                }
+                for (int i = 0; i < n_threads[t]; i++) {
+                    pthread_join(workers[i].thread, NULL);
+                    total += workers[i].iterations;
+                }
+                mcts_end(&obj, visits);
+            }
+            elapsed += now_s() - t0;
+            printf(" %2d", mcts_best_move(visits));
+            mcts_info_exit(&obj);
+        }
+        printf("  %10.0f iterations/s\n", total / elapsed);
+    }
+}
+
+/* Random playouts per second from every position, one at a time and in
+ * batches of ROLLOUT_LANES, with the outcomes for the player to move as a
+ * sanity check of the move distribution.
+ */
+static void bench_rollout(void)
+{
+    struct state_array xoro;
+
+    xoro_init(&xoro);
+    printf("rollout: %d playouts per position\n", BENCH_ROLLOUTS);
+    for (size_t p = 0; p < N_POSITIONS; p++) {
+        board_t board;
+        char player = load_position(positions[p], &board);
+        int results[3] = {0};
+
+        double t0 = now_s();
+        for (int i = 0; i < BENCH_ROLLOUTS; i++)
+            results[rollout(&xoro, &board, player) >>
+                    (FIXED_SCALE_BITS - 1)]++;
+        double elapsed = now_s() - t0;
+        printf("  \"%s\"  single %10.0f playouts/s  (%d/%d/%d)\n",
+               positions[p], BENCH_ROLLOUTS / elapsed, results[0],
+               results[1], results[2]);
+
+        memset(results, 0, sizeof(results));
+        t0 = now_s();
+        for (int i = 0; i < BENCH_ROLLOUTS; i += ROLLOUT_LANES) {
+            fixed_point_t scores[ROLLOUT_LANES];
+            rollout_batch(&xoro, &board, player, scores);
+            for (int j = 0; j < ROLLOUT_LANES; j++)
+                results[scores[j] >> (FIXED_SCALE_BITS - 1)]++;
+        }
+        elapsed = now_s() - t0;
+        printf("  %*s  batch  %10.0f playouts/s  (%d/%d/%d)\n", N_GRIDS + 2,
+               "", BENCH_ROLLOUTS / elapsed, results[0], results[1],
+               results[2]);
+    }
+    printf("  (wins/draws/losses of the player to move)\n");
+}
+
+/* Tree against DAG mode: nodes allocated by a search of ITERATIONS playouts,
+ * or fewer once the root is proven, and playouts until the best move stops
+ * changing, checked every BENCH_STEP playouts. Both are averaged over
+ * BENCH_SEEDS generator streams.
+ */
+static void bench_mcts_dag(void)
+{
+    struct mcts_info obj;
+
+    printf("mcts-dag: %d playouts, best move checked every %d\n", ITERATIONS,
+           BENCH_STEP);
+    for (int dag = 0; dag < 2; dag++) {
+        printf("  %s\n", dag ? "dag" : "tree");
+        for (size_t p = 0; p < N_POSITIONS; p++) {
+            board_t board;
+            char player = load_position(positions[p], &board);
+            long long nodes = 0, converged = 0;
+
+            for (int seed = 0; seed < BENCH_SEEDS; seed++) {
+                int visits[N_GRIDS], best = -1, n = 0, last_change = 0;
+
+                if (mcts_info_init(&obj, 1 << 20, seed) < 0 ||
+                    (dag && mcts_info_enable_dag(&obj) < 0))
+                    exit(1);
+                mcts_begin(&obj, &board, player, 0);
+                while (n < ITERATIONS) {
+                    int step = mcts_run(&obj, BENCH_STEP);
+                    mcts_end(&obj, visits);
+                    if (!step)
+                        break; /* the root is proven */
+                    n += step;
+                    if (mcts_best_move(visits) != best) {
+                        best = mcts_best_move(visits);
+                        last_change = n;
+                    }
+                }
+                nodes += obj.nr_active_nodes;
+                converged += last_change;
+                mcts_info_exit(&obj);
+            }
+            printf("    \"%s\"  %8lld nodes  stable after %6lld playouts\n",
+                   positions[p], nodes / BENCH_SEEDS,
+                   converged / BENCH_SEEDS);
+        }
+    }
+}
+
+/* Positions with a single winning move, which neither wins at once nor
+ * blocks an immediate threat
+ */
+static const char *rave_positions[] = {
+    "          X  O  ", "O  O  X      X  ", "      O    X O  ",
+    "X    O      O   ", "      OX     O  ", " X    O        O",
+    "O    X O      X ", "    O    X      ",
+};
+#define N_RAVE_POSITIONS (sizeof(rave_positions) / sizeof(rave_positions[0]))
+
+static int rave_settle(const board_t *board,
+                       char player,
+                       int rave,
+                       int seed,
+                       int target)
+{
+    struct mcts_info obj;
+    int visits[N_GRIDS], n = 0, settled = -1;
+
+    if (mcts_info_init(&obj, 1 << 20, seed) < 0 ||
+        (rave && mcts_info_enable_rave(&obj) < 0))
+        exit(1);
+    mcts_begin(&obj, board, player, 0);
+    while (n < ITERATIONS) {
+        int step = mcts_run(&obj, BENCH_RAVE_STEP);
+        mcts_end(&obj, visits);
+        if (!step)
+            break; /* the root is proven */
+        n += step;
+        if (mcts_best_move(visits) != target)
+            settled = -1;
+        else if (settled < 0)
+            settled = n;
+    }
+    mcts_info_exit(&obj);
+    return settled;
+}
+
+/* Playouts until a search settles on the move plain UCT picks after
+ * ITERATIONS playouts (the most frequent one over BENCH_SEEDS streams), with
+ * and without RAVE. The best move is checked every BENCH_RAVE_STEP playouts,
+ * and the search counts as settled from the first check after which it never
+ * differs from that move again. Searches that end on another move are
+ * counted as misses.
+ */
+static void bench_mcts_rave(void)
+{
+    printf("mcts-rave: playouts until the move of %d-playout UCT is kept\n",
+           ITERATIONS);
+    for (size_t p = 0; p < N_RAVE_POSITIONS; p++) {
+        board_t board;
+        char player = load_position(rave_positions[p], &board);
+        int votes[N_GRIDS] = {0}, target = 0;
+
+        for (int seed = 0; seed < BENCH_SEEDS; seed++) {
+            struct mcts_info obj;
+            int visits[N_GRIDS];
+            if (mcts_info_init(&obj, 1 << 20, seed) < 0)
+                exit(1);
+            mcts_search(&obj, &board, player, 0, visits);
+            votes[mcts_best_move(visits)]++;
+            mcts_info_exit(&obj);
+        }
+        for (int i = 0; i < N_GRIDS; i++) {
+            if (votes[i] > votes[target])
+                target = i;
+        }
+
+        printf("  \"%s\"  move %2d", rave_positions[p], target);
+        for (int rave = 0; rave < 2; rave++) {
+            long long total = 0;
+            int hits = 0;
+            for (int seed = 0; seed < BENCH_SEEDS; seed++) {
+                int settled = rave_settle(&board, player, rave, seed, target);
+                if (settled >= 0) {
+                    total += settled;
+                    hits++;
+                }
+            }
+            printf("  %s %6lld (%d/%d)", rave ? "rave" : "uct ",
+                   hits ? total / hits : 0, hits, BENCH_SEEDS);
+        }
+        printf("\n");
+    }
+}
+
+/* Empty the transposition table by allocating a new one */
+static void negamax_reset(void)
+{
+    negamax_exit();
+    if (negamax_init(ZOBRIST_TT_KB, 0) < 0)
+        exit(1);
+}
+
+/* Time and nodes visited per negamax search from every position with an
+ * empty transposition table, and time per move of a game played on from
+ * there by negamax against itself with the table kept, each averaged over
+ * BENCH_NEGAMAX_RUNS runs. Then the cost of storing and probing BENCH_TT_OPS
+ * transposition table entries with spread-out keys.
+ */
+static void bench_negamax(void)
+{
+    printf("negamax: %d runs per position\n", BENCH_NEGAMAX_RUNS);
+    for (size_t p = 0; p < N_POSITIONS; p++) {
+        double search = 0, game = 0;
+        unsigned long nodes = 0;
+        int moves = 0, first = -1;
+
+        for (int i = 0; i < BENCH_NEGAMAX_RUNS; i++) {
+            board_t board;
+            char player = load_position(positions[p], &board);
+
+            negamax_reset();
+            for (int n = 0; check_win(&board) == ' '; n++) {
+                struct negamax_context ctx;
+                double t0 = now_s();
+                negamax_context_init(&ctx, &board, player);
+                int move = negamax_search(&ctx).move;
+                double elapsed = now_s() - t0;
+                if (!n) {
+                    search += elapsed;
+                    nodes += ctx.nodes;
+                    first = move;
+                }
+                game += elapsed;
+                moves++;
+                board_play(&board, move, player);
+                player ^= 'O' ^ 'X';
+            }
+        }
+        printf("  \"%s\"  move %2d  %8.1f us/search  %6lu nodes/search  "
+               "%8.1f us/game move\n",
+               positions[p], first, search * 1e6 / BENCH_NEGAMAX_RUNS,
+               nodes / BENCH_NEGAMAX_RUNS, game * 1e6 / moves);
+    }
+
+    zobrist_data_t data;
+    int hits = 0;
+    zobrist_clear();
+    double t0 = now_s();
+    for (u64 i = 1; i <= BENCH_TT_OPS; i++)
+        zobrist_put(i * 0x9e3779b97f4a7c15ULL, i & 7, ZOBRIST_EXACT, 0, 0);
+    double t1 = now_s();
+    for (u64 i = 1; i <= BENCH_TT_OPS; i++)
+        hits += zobrist_get(i * 0x9e3779b97f4a7c15ULL, &data);
+    double t2 = now_s();
+    printf("  tt: %.1f ns/store  %.1f ns/probe  (%d/%d found)\n",
+           (t1 - t0) * 1e9 / BENCH_TT_OPS, (t2 - t1) * 1e9 / BENCH_TT_OPS,
+           hits, BENCH_TT_OPS);
+}
+
+struct negamax_helper {
+    pthread_t thread;
+    struct negamax_context ctx;
+};
+
+static void *negamax_helper_func(void *arg)
+{
+    struct negamax_helper *h = arg;
+    negamax_search_depth(&h->ctx, BENCH_SMP_DEPTH);
+    return NULL;
+}
+
+/* Time for the main search of a Lazy SMP search with helpers - 1 helpers,
+ * starting from an empty transposition table, to complete BENCH_SMP_DEPTH
+ * plies
+ */
+static double negamax_smp_time(const board_t *board,
+                               char player,
+                               int threads,
+                               int *move)
+{
+    struct negamax_helper helpers[threads];
+    struct negamax_context ctx;
+    int stop = 0;
+
+    negamax_reset();
+    double t0 = now_s();
+    zobrist_clear();
+    for (int i = 1; i < threads; i++) {
+        negamax_context_init(&helpers[i].ctx, board, player);
+        negamax_context_helper(&helpers[i].ctx, i, &stop);
+        pthread_create(&helpers[i].thread, NULL, negamax_helper_func,
+                       &helpers[i]);
+    }
+    negamax_context_init(&ctx, board, player);
+    *move = negamax_search_depth(&ctx, BENCH_SMP_DEPTH).move;
+    double elapsed = now_s() - t0;
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 1; i < threads; i++)
+        pthread_join(helpers[i].thread, NULL);
+    return elapsed;
+}
+
+static void bench_negamax_smp(void)
+{
+    static const int threads[] = {1, 2, 4, 8};
+
+    printf("negamax-smp: time to depth %d (best of %d), speedup over 1 "
+           "thread\n",
+           BENCH_SMP_DEPTH, BENCH_SMP_RUNS);
+    for (size_t p = 0; p < N_POSITIONS; p++) {
+        board_t board;
+        char player = load_position(positions[p], &board);
+        double base = 0;
+
+        printf("  \"%s\"", positions[p]);
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            double best = 0;
+            int move;
+            for (int run = 0; run < BENCH_SMP_RUNS; run++) {
+                double elapsed =
+                    negamax_smp_time(&board, player, threads[t], &move);
+                if (!run || elapsed < best)
+                    best = elapsed;
+            }
+            if (!t)
+                base = best;
+            printf("  %dT %6.0f us %4.2fx", threads[t], best * 1e6,
+                   base / best);
+        }
+        printf("\n");
+    }
+}
+
+static void bench_tablebase(void)
+{
+    static const char *value_name[] = {"?", "win", "draw", "loss"};
+
+    if (tablebase_load(TABLEBASE_FILE) < 0) {
+        printf("tablebase: skipped, run \"make " TABLEBASE_FILE "\" first\n");
+        return;
+    }
+    printf("tablebase: %d probes per position\n", BENCH_TB_PROBES);
+    for (size_t p = 0; p < N_POSITIONS; p++) {
+        board_t board;
+        char player = load_position(positions[p], &board);
+        int move = -1, value = 0;
+
+        double t0 = now_s();
+        for (int i = 0; i < BENCH_TB_PROBES; i++)
+            move = tablebase_probe(&board, player, &value);
+        double elapsed = now_s() - t0;
+        printf("  \"%s\"  move %2d  %-4s  %6.1f ns/probe\n", positions[p],
+               move, value_name[move < 0 ? 0 : value],
+               elapsed * 1e9 / BENCH_TB_PROBES);
+    }
+    tablebase_unload();
+}
+
+static void bench_book(void)
+{
+    printf("book: %d probes per position\n", BENCH_BOOK_PROBES);
+    for (size_t p = 0; p < N_POSITIONS; p++) {
+        board_t board;
+        char player = load_position(positions[p], &board);
+        int move = -1;
+
+        double t0 = now_s();
+        for (int i = 0; i < BENCH_BOOK_PROBES; i++)
+            move = book_probe(&board, player);
+        double elapsed = now_s() - t0;
+        printf("  \"%s\"  move %2d  %6.1f ns/probe\n", positions[p], move,
+               elapsed * 1e9 / BENCH_BOOK_PROBES);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*func)(void);
+} benches[] = {
+    {"mcts-tree", bench_mcts_tree},
+    {"rollout", bench_rollout},
+    {"mcts-dag", bench_mcts_dag},
+    {"mcts-rave", bench_mcts_rave},
+    {"negamax", bench_negamax},
+    {"negamax-smp", bench_negamax_smp},
+    {"tablebase", bench_tablebase},
+    {"book", bench_book},
+};
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+int main(int argc, char *argv[])
+{
+    game_init();
+    if (negamax_init(ZOBRIST_TT_KB, 0) < 0)
+        return 1;
+    for (size_t i = 0; i < N_BENCHES; i++) {
+        bool selected = argc < 2;
+        for (int j = 1; j < argc; j++)
+            selected |= !strcmp(argv[j], benches[i].name);
+        if (selected)
+            benches[i].func();
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include "book.h"
+#include "book_table.h"
+
+#define BOOK_SIZE (sizeof(book) / sizeof(book[0]))
+
+int book_probe(const board_t *board, char player)
+{
+    int n_o = popcount16(board->mask[0]), n_x = popcount16(board->mask[1]);
+    board_t canon;
+
+    if (n_o + n_x >= BOOK_PLIES || PLAYER_ID(player) != (n_o != n_x))
+        return -1;
+
+    int t = board_canonical(board, &canon);
+    uint32_t key = canon.mask[0] | (uint32_t) canon.mask[1] << 16;
+    int lo = 0, hi = BOOK_SIZE;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (book[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == BOOK_SIZE || book[lo].key != key || book[lo].move < 0)
+        return -1;
+    return sym_grid[sym_inverse[t]][book[lo].move];
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "game.h"
+
+/* An opening book reply: key is mask[0] | mask[1] << 16 of a canonical
+ * position (see board_canonical()) and move is given on that position.
+ */
+struct book_entry {
+    uint32_t key;
+    int8_t move;
+};
+
+/* Reply to board for player from the opening book compiled in from
+ * book_table.h, or -1 past the plies it covers. The book assumes 'O' moved
+ * first.
+ */
+int book_probe(const board_t *board, char player);
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "./user_space_ai/mcts.h"
+#include "./user_space_ai/negamax.h"
+#include "./user_space_ai/zobrist.h"
+#include "book.h"
+#include "game.h"
+
+/* Write the opening book read by book_probe() to stdout: the reply to every
+ * position reachable in fewer than "plies" moves from the empty board, one
+ * per class of symmetric positions. Run "./bookgen [plies]".
+ *
+ * Each side's reply is searched by the engine that plays it, at a budget
+ * far beyond what a move is given in a game: MCTS for 'O' and negamax for
+ * 'X', the pairing of ai_one_work_func() and ai_two_work_func().
+ */
+
+#define BOOKGEN_PLIES 4
+#define BOOKGEN_PLAYOUTS (1 << 21)
+#define BOOKGEN_ARENA_SIZE (1 << 23)
+#define BOOKGEN_NEGAMAX_DEPTH 10
+#define BOOKGEN_MAX_ENTRIES 4096
+
+/* Fixed Zobrist keys, so that the transposition table, and with it the
+ * choice among moves of equal score, is the same on every run
+ */
+#define BOOKGEN_SEED 0x6b786f626f6f6bULL
+
+static struct book_entry entries[BOOKGEN_MAX_ENTRIES];
+static int n_entries;
+static struct mcts_info mcts_obj;
+
+static inline uint32_t board_key(const board_t *board)
+{
+    return board->mask[0] | (uint32_t) board->mask[1] << 16;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    uint32_t x = ((const struct book_entry *) a)->key;
+    uint32_t y = ((const struct book_entry *) b)->key;
+    return (x > y) - (x < y);
+}
+
+static int search(const board_t *board, char player)
+{
+    if (player == 'O') {
+        int visits[N_GRIDS];
+        mcts_begin(&mcts_obj, board, player, 0);
+        mcts_run(&mcts_obj, BOOKGEN_PLAYOUTS);
+        mcts_end(&mcts_obj, visits);
+        return mcts_best_move(visits);
+    }
+
+    struct negamax_context ctx;
+    negamax_context_init(&ctx, board, player);
+    zobrist_clear();
+    return negamax_search_depth(&ctx, BOOKGEN_NEGAMAX_DEPTH).move;
+}
+
+/* Add the canonical positions from board onwards that are still in the book
+ * to entries, depth-first.
+ */
+static void walk(const board_t *board, char player, int ply, int plies)
+{
+    board_t canon;
+
+    board_canonical(board, &canon);
+    for (int i = 0; i < n_entries; i++) {
+        if (entries[i].key == board_key(&canon))
+            return;
+    }
+    if (n_entries == BOOKGEN_MAX_ENTRIES) {
+        fprintf(stderr, "[bookgen] more than %d positions\n", n_entries);
+        exit(1);
+    }
+    entries[n_entries].key = board_key(&canon);
+    entries[n_entries++].move = search(&canon, player);
+
+    if (ply + 1 == plies)
+        return;
+    for_each_empty_grid(move, &canon) {
+        board_t next = canon;
+        board_play(&next, move, player);
+        if (check_win_after(&next, move) == ' ')
+            walk(&next, player ^ 'O' ^ 'X', ply + 1, plies);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int plies = argc > 1 ? atoi(argv[1]) : BOOKGEN_PLIES;
+    board_t board;
+
+    if (plies < 1 || plies > N_GRIDS) {
+        fprintf(stderr, "[bookgen] plies must be in 1..%d\n", N_GRIDS);
+        return 1;
+    }
+    game_init();
+    if (negamax_init(ZOBRIST_TT_KB, BOOKGEN_SEED) < 0 ||
+        mcts_info_init(&mcts_obj, BOOKGEN_ARENA_SIZE, 0) < 0)
+        return 1;
+
+    board_init(&board);
+    walk(&board, 'O', 0, plies);
+    qsort(entries, n_entries, sizeof(entries[0]), cmp_entry);
+
+    printf("/* Generated by bookgen, do not edit: the replies to the positions "
+           "of the\n * first %d plies, see book_probe()\n */\n\n",
+           plies);
+    printf("#define BOOK_PLIES %d\n\n", plies);
+    printf("static const struct book_entry book[] = {\n");
+    for (int i = 0; i < n_entries; i++)
+        printf("    {0x%08x, %d},\n", entries[i].key, entries[i].move);
+    printf("};\n");
+
+    mcts_info_exit(&mcts_obj);
+    negamax_exit();
+    return 0;
+}
@@ -1,22 +1,5 @@
-#ifdef __KERNEL__
-#include <linux/slab.h>
-#else
-#include <stdint.h>
-#include <stdlib.h>
-typedef uint64_t u64;
-#endif
-
 #include "game.h"
 
-static inline void *kxo_alloc(size_t size)
-{
-#ifdef __KERNEL__
-    return kzalloc(size, GFP_KERNEL);
-#else
-    return calloc(1, size);
-#endif
-}
-
 const line_t lines[4] = {
     {0, 1, 0, 0, BOARD_SIZE, BOARD_SIZE - GOAL + 1},             // ROW
     {1, 0, 0, 0, BOARD_SIZE - GOAL + 1, BOARD_SIZE},             // COL
@@ -24,41 +7,127 @@ const line_t lines[4] = {
     {1, -1, 0, GOAL - 1, BOARD_SIZE - GOAL + 1, BOARD_SIZE},     // SECONDARY
 };
 
-static char check_line_segment_win(const char *t, int i, int j, line_t line)
-{
-    char last = t[GET_INDEX(i, j)];
-    if (last == ' ')
-        return ' ';
-    for (int k = 1; k < GOAL; k++) {
-        if (last != t[GET_INDEX(i + k * line.i_shift, j + k * line.j_shift)])
-            return ' ';
-    }
+/* Grid masks used to build line_masks[] at compile time */
+#define ROW_REPEAT(bits) ((bits) * (BOARD_MASK / ((1U << BOARD_SIZE) - 1)))
+#define COLS_LT(n) ROW_REPEAT((1U << (n)) - 1)
+#define COLS_GE(n) ROW_REPEAT(((1U << BOARD_SIZE) - 1) & ~((1U << (n)) - 1))
+#define ROWS_LT(n) ((1U << ((n) * BOARD_SIZE)) - 1)
+#define SEGMENT(step) (((1U << (GOAL * (step))) - 1) / ((1U << (step)) - 1))
+#define LINE_MASK(step, origins) {(step), (origins), SEGMENT(step)}
 
 #if !ALLOW_EXCEED
-    if (last == LOOKUP(t, i - line.i_shift, j - line.j_shift, ' ') ||
-        last ==
-            LOOKUP(t, i + GOAL * line.i_shift, j + GOAL * line.j_shift, ' '))
-        return ' ';
+#error "the bitboard win test does not implement ALLOW_EXCEED == 0"
 #endif
-    return last;
+
+const line_mask_t line_masks[4] = {
+    LINE_MASK(1, COLS_LT(N_FIT)),                                   // ROW
+    LINE_MASK(BOARD_SIZE, ROWS_LT(N_FIT)),                          // COL
+    LINE_MASK(BOARD_SIZE + 1, ROWS_LT(N_FIT) & COLS_LT(N_FIT)),     // PRIMARY
+    LINE_MASK(BOARD_SIZE - 1, ROWS_LT(N_FIT) & COLS_GE(GOAL - 1)),  // SECONDARY
+};
+
+uint16_t win_segments[N_SEGMENTS];
+grid_segments_t grid_segments[N_GRIDS];
+
+uint8_t sym_grid[N_SYMMETRIES][N_GRIDS];
+uint8_t sym_inverse[N_SYMMETRIES];
+uint16_t sym_byte[N_SYMMETRIES][2][256];
+
+static void sym_init(void)
+{
+    for (int t = 0; t < N_SYMMETRIES; t++) {
+        for (int i = 0; i < N_GRIDS; i++) {
+            int row = GET_ROW(i), col = GET_COL(i);
+            if (t & 4) {
+                int tmp = row;
+                row = col;
+                col = tmp;
+            }
+            if (t & 2)
+                row = BOARD_SIZE - 1 - row;
+            if (t & 1)
+                col = BOARD_SIZE - 1 - col;
+            sym_grid[t][i] = GET_INDEX(row, col);
+        }
+        for (int b = 0; b < 2; b++) {
+            for (int bits = 0; bits < 256; bits++) {
+                uint16_t mask = 0;
+                for_each_bit(k, bits & (BOARD_MASK >> (8 * b)))
+                    mask |= 1U << sym_grid[t][8 * b + k];
+                sym_byte[t][b][bits] = mask;
+            }
+        }
+    }
+
+    for (int t = 0; t < N_SYMMETRIES; t++) {
+        for (int u = 0; u < N_SYMMETRIES; u++) {
+            int i = 0;
+            while (i < N_GRIDS && sym_grid[u][sym_grid[t][i]] == i)
+                i++;
+            if (i == N_GRIDS)
+                sym_inverse[t] = u;
+        }
+    }
 }
 
-char check_win(const char *t)
+void game_init(void)
 {
+    int n = 0;
+
+    sym_init();
+
+    for (int i = 0; i < N_GRIDS; i++)
+        grid_segments[i].n = 0;
+
     for (int i_line = 0; i_line < 4; ++i_line) {
         line_t line = lines[i_line];
         for (int i = line.i_lower_bound; i < line.i_upper_bound; ++i) {
             for (int j = line.j_lower_bound; j < line.j_upper_bound; ++j) {
-                char win = check_line_segment_win(t, i, j, line);
-                if (win != ' ')
-                    return win;
+                uint16_t segment = 0;
+                for (int k = 0; k < GOAL; k++)
+                    segment |= 1U << GET_INDEX(i + k * line.i_shift,
+                                               j + k * line.j_shift);
+                for_each_bit(grid, segment) {
+                    grid_segments_t *gs = &grid_segments[grid];
+                    gs->segment[gs->n] = segment;
+                    gs->id[gs->n++] = n;
+                }
+                win_segments[n++] = segment;
             }
         }
     }
-    for (int i = 0; i < N_GRIDS; i++)
-        if (t[i] == ' ')
-            return ' ';
-    return 'D';
+}
+
+/* Return the origins of every GOAL-length segment fully covered by bits */
+static inline uint16_t line_hits(uint16_t bits, const line_mask_t *line)
+{
+    uint16_t hits = bits & line->origins;
+    for (int k = 1; k < GOAL; k++)
+        hits &= bits >> (k * line->step);
+    return hits;
+}
+
+char check_win(const board_t *board)
+{
+    for (int p = 0; p < 2; p++) {
+        for (int i_line = 0; i_line < 4; ++i_line) {
+            if (line_hits(board->mask[p], &line_masks[i_line]))
+                return PLAYER_CHAR(p);
+        }
+    }
+    return board_empty(board) ? ' ' : 'D';
+}
+
+/* Same result as check_win(), provided the game was still running before
+ * move was played: only the segments through move can have been completed.
+ */
+char check_win_after(const board_t *board, int move)
+{
+    int p = !!(board->mask[1] & (1U << move));
+
+    if (wins_through(board->mask[p], move))
+        return PLAYER_CHAR(p);
+    return board_empty(board) ? ' ' : 'D';
 }
 
 fixed_point_t calculate_win_value(char win, char player)
@@ -70,14 +139,56 @@ fixed_point_t calculate_win_value(char win, char player)
     return 1U << (FIXED_SCALE_BITS - 1);
 }
 
-int *available_moves(const char *table)
+int available_moves(const board_t *board, int *moves)
 {
-    int *moves = kxo_alloc(N_GRIDS * sizeof(int));
     int m = 0;
-    for (int i = 0; i < N_GRIDS; i++)
-        if (table[i] == ' ')
+    for_each_empty_grid(i, board)
+        moves[m++] = i;
+    return m;
+}
+
+/* Like available_moves(), but of the moves that a symmetry of the board
+ * maps onto each other only the one on the lowest grid is kept, as they
+ * lead to equivalent positions.
+ */
+int unique_moves(const board_t *board, int *moves)
+{
+    int syms[N_SYMMETRIES], n_syms = 0, m = 0;
+
+    for (int t = 1; t < N_SYMMETRIES; t++) {
+        if (sym_mask(t, board->mask[0]) == board->mask[0] &&
+            sym_mask(t, board->mask[1]) == board->mask[1])
+            syms[n_syms++] = t;
+    }
+    for_each_empty_grid(i, board) {
+        int k = 0;
+        while (k < n_syms && sym_grid[syms[k]][i] >= i)
+            k++;
+        if (k == n_syms)
             moves[m++] = i;
-    if (m < N_GRIDS)
-        moves[m] = -1;
-    return moves;
+    }
+    return m;
+}
+
+/* Store in canon the image of board with the smallest value of
+ * mask[0] | mask[1] << 16 among its symmetries, and return the symmetry t
+ * that maps board onto it. Symmetric positions share one canonical form.
+ */
+int board_canonical(const board_t *board, board_t *canon)
+{
+    uint32_t best = ~0U;
+    int best_t = 0;
+
+    for (int t = 0; t < N_SYMMETRIES; t++) {
+        uint16_t o = sym_mask(t, board->mask[0]);
+        uint16_t x = sym_mask(t, board->mask[1]);
+        uint32_t key = o | (uint32_t) x << 16;
+        if (key < best) {
+            best = key;
+            best_t = t;
+            canon->mask[0] = o;
+            canon->mask[1] = x;
+        }
+    }
+    return best_t;
 }
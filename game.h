@@ -1,5 +1,12 @@
 #pragma once
 
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
 #define BOARD_SIZE 4
 #define GOAL 3
 #define ALLOW_EXCEED 1
@@ -8,15 +15,98 @@
 #define GET_COL(x) ((x) % BOARD_SIZE)
 #define GET_ROW(x) ((x) / BOARD_SIZE)
 
-#define for_each_empty_grid(i, table) \
-    for (int i = 0; i < N_GRIDS; i++) \
-        if (table[i] == ' ')
+#if N_GRIDS > 16
+#error "board_t keeps one bit per grid in a 16-bit mask"
+#endif
+
+/* Bitboard game state: bit i of mask[p] is set when grid i is taken by
+ * player p, where p is 0 for 'O' and 1 for 'X'.
+ */
+typedef struct {
+    uint16_t mask[2];
+} board_t;
+
+#define BOARD_MASK ((uint16_t) ((1U << N_GRIDS) - 1))
+#define PLAYER_ID(player) ((player) == 'X')
+#define PLAYER_CHAR(id) ((id) ? 'X' : 'O')
+
+/* Iterate over the set bits of a 16-bit mask, lowest index first */
+#define for_each_bit(i, bits)                        \
+    for (uint16_t __bits = (bits), i;                \
+         __bits && ((i = __builtin_ctz(__bits)), 1); \
+         __bits &= __bits - 1)
+
+#define for_each_empty_grid(i, board) for_each_bit(i, board_empty(board))
+
+#ifdef __KERNEL__
+#define popcount16(x) hweight16(x)
+#else
+#define popcount16(x) __builtin_popcount(x)
+#endif
+
+static inline void board_init(board_t *board)
+{
+    board->mask[0] = board->mask[1] = 0;
+}
+
+static inline uint16_t board_empty(const board_t *board)
+{
+    return ~(board->mask[0] | board->mask[1]) & BOARD_MASK;
+}
+
+static inline char board_get(const board_t *board, int i)
+{
+    if (board->mask[0] & (1U << i))
+        return 'O';
+    if (board->mask[1] & (1U << i))
+        return 'X';
+    return ' ';
+}
+
+static inline void board_play(board_t *board, int i, char player)
+{
+    board->mask[PLAYER_ID(player)] |= 1U << i;
+}
+
+static inline void board_undo(board_t *board, int i, char player)
+{
+    board->mask[PLAYER_ID(player)] &= ~(1U << i);
+}
 
 typedef struct {
     int i_shift, j_shift;
     int i_lower_bound, j_lower_bound, i_upper_bound, j_upper_bound;
 } line_t;
 
+/* Bitboard view of a line_t: a GOAL-length segment starting at grid k is
+ * (segment << k), and origins holds every k where such a segment fits.
+ */
+typedef struct {
+    int step;
+    uint16_t origins;
+    uint16_t segment;
+} line_mask_t;
+
+/* Every GOAL-length winning segment on the board, and for each grid the
+ * segments passing through it, filled in once by game_init().
+ */
+#define N_FIT (BOARD_SIZE - GOAL + 1)
+#define N_SEGMENTS (2 * BOARD_SIZE * N_FIT + 2 * N_FIT * N_FIT)
+#define MAX_GRID_SEGMENTS (4 * GOAL)
+
+/* Index of the pattern of a winning segment holding o stones of 'O' and x
+ * of 'X', which is all the evaluation looks at. util.h scores patterns
+ * through tables generated for GOAL by linegen.
+ */
+#define LINE_INDEX(o, x) ((o) * (GOAL + 1) + (x))
+#define LINE_PATTERNS ((GOAL + 1) * (GOAL + 1))
+
+typedef struct {
+    int n;
+    uint16_t segment[MAX_GRID_SEGMENTS];
+    uint8_t id[MAX_GRID_SEGMENTS]; /* index of segment[i] in win_segments */
+} grid_segments_t;
+
 /* Self-defined fixed-point type, using last 10 bits as fractional bits,
  * starting from lsb */
 #define FIXED_SCALE_BITS 8
@@ -33,7 +123,45 @@ typedef unsigned fixed_point_t;
      ((BOARD_SIZE << 1) + 1) + 1)
 
 extern const line_t lines[4];
+extern const line_mask_t line_masks[4];
+extern uint16_t win_segments[N_SEGMENTS];
+extern grid_segments_t grid_segments[N_GRIDS];
+
+/* Whether the stones in mask complete a segment through grid move, i.e.
+ * whether placing a stone at move won the game for the owner of mask.
+ */
+static inline int wins_through(uint16_t mask, int move)
+{
+    const grid_segments_t *gs = &grid_segments[move];
+
+    for (int i = 0; i < gs->n; i++) {
+        if ((mask & gs->segment[i]) == gs->segment[i])
+            return 1;
+    }
+    return 0;
+}
+
+/* The 8 symmetries of the square board: symmetry t transposes the board if
+ * bit 2 of t is set, then reverses the order of the rows if bit 1 is set
+ * and of the columns if bit 0 is set. It moves grid i to sym_grid[t][i], and
+ * sym_inverse[t] moves it back. A mask is mapped one byte at a time through
+ * sym_byte[t].
+ */
+#define N_SYMMETRIES 8
+
+extern uint8_t sym_grid[N_SYMMETRIES][N_GRIDS];
+extern uint8_t sym_inverse[N_SYMMETRIES];
+extern uint16_t sym_byte[N_SYMMETRIES][2][256];
+
+static inline uint16_t sym_mask(int t, uint16_t mask)
+{
+    return sym_byte[t][0][mask & 0xff] | sym_byte[t][1][mask >> 8];
+}
 
-int *available_moves(const char *table);
-char check_win(const char *t);
+void game_init(void);
+int available_moves(const board_t *board, int *moves);
+int unique_moves(const board_t *board, int *moves);
+int board_canonical(const board_t *board, board_t *canon);
+char check_win(const board_t *board);
+char check_win_after(const board_t *board, int move);
 fixed_point_t calculate_win_value(char win, char player);
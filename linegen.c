@@ -0,0 +1,59 @@
+#include <stdio.h>
+
+#include "game.h"
+
+/* Write line_table.h to stdout: the score for 'O' and the winner of every
+ * pattern a winning segment can hold, indexed by LINE_INDEX() for the GOAL
+ * in game.h. The weights of the evaluation are set here. Indices with more
+ * than GOAL stones in all are never used.
+ */
+
+/* A segment holding stones of both players can no longer be completed and
+ * is worth nothing. Otherwise n stones of one player are worth 10^(n - 1)
+ * to them.
+ */
+static int pattern_score(int o, int x)
+{
+    int count = o ? o : x, score = 1;
+
+    if ((o && x) || !count)
+        return 0;
+    while (--count)
+        score *= 10;
+    return o ? score : -score;
+}
+
+static char pattern_winner(int o, int x)
+{
+    if (o == GOAL)
+        return 'O';
+    if (x == GOAL)
+        return 'X';
+    return ' ';
+}
+
+int main(void)
+{
+    printf("/* Generated by linegen for GOAL %d, do not edit: see "
+           "LINE_INDEX() */\n\n",
+           GOAL);
+
+    printf("static const int line_score[LINE_PATTERNS] = {\n");
+    for (int o = 0; o <= GOAL; o++) {
+        printf("   ");
+        for (int x = 0; x <= GOAL; x++)
+            printf(" %d,", o + x <= GOAL ? pattern_score(o, x) : 0);
+        printf("\n");
+    }
+    printf("};\n\n");
+
+    printf("static const char line_winner[LINE_PATTERNS] = {\n");
+    for (int o = 0; o <= GOAL; o++) {
+        printf("   ");
+        for (int x = 0; x <= GOAL; x++)
+            printf(" '%c',", o + x <= GOAL ? pattern_winner(o, x) : ' ');
+        printf("\n");
+    }
+    printf("};\n");
+    return 0;
+}
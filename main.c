@@ -3,6 +3,7 @@
 #include <linux/cdev.h>
 #include <linux/circ_buf.h>
 #include <linux/interrupt.h>
+#include <linux/math64.h>
 #include <linux/kfifo.h>
 #include <linux/module.h>
 #include <linux/slab.h>
@@ -11,9 +12,12 @@
 #include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 
+#include "book.h"
 #include "game.h"
 #include "mcts.h"
 #include "negamax.h"
+#include "tablebase.h"
+#include "zobrist.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
@@ -32,6 +36,56 @@ MODULE_DESCRIPTION("In-kernel Tic-Tac-Toe game engine");
 
 static int delay = 100; /* time (in ms) to generate an event */
 
+static int mcts_arena_nodes = MCTS_ARENA_SIZE;
+module_param(mcts_arena_nodes, int, 0444);
+MODULE_PARM_DESC(mcts_arena_nodes, "Nodes preallocated for one MCTS search");
+
+static int mcts_budget_us;
+module_param(mcts_budget_us, int, 0644);
+MODULE_PARM_DESC(mcts_budget_us,
+                 "MCTS time budget per move in usec (0: fixed iterations)");
+
+static int mcts_threads = 1;
+module_param(mcts_threads, int, 0444);
+MODULE_PARM_DESC(mcts_threads, "Independent MCTS searches run for each move");
+
+static bool mcts_shared_tree;
+module_param(mcts_shared_tree, bool, 0644);
+MODULE_PARM_DESC(mcts_shared_tree,
+                 "MCTS workers grow one shared tree instead of one each");
+
+static bool mcts_dag;
+module_param(mcts_dag, bool, 0444);
+MODULE_PARM_DESC(mcts_dag,
+                 "MCTS shares nodes between transpositions (no shared tree)");
+
+static bool mcts_rave;
+module_param(mcts_rave, bool, 0444);
+MODULE_PARM_DESC(mcts_rave, "MCTS blends in AMAF statistics (no shared tree)");
+
+static unsigned int negamax_tt_kb = ZOBRIST_TT_KB;
+module_param(negamax_tt_kb, uint, 0444);
+MODULE_PARM_DESC(negamax_tt_kb,
+                 "Negamax transposition table size in KiB (rounded down to a "
+                 "power of 2)");
+
+static int negamax_depth = MAX_SEARCH_DEPTH;
+module_param(negamax_depth, int, 0644);
+MODULE_PARM_DESC(negamax_depth,
+                 "Negamax search depth in plies (2 to the number of grids, "
+                 "odd depths round down)");
+
+static int negamax_helpers;
+module_param(negamax_helpers, int, 0444);
+MODULE_PARM_DESC(negamax_helpers,
+                 "Lazy SMP helper searches run next to each negamax search");
+
+static char *tablebase;
+module_param(tablebase, charp, 0444);
+MODULE_PARM_DESC(tablebase,
+                 "Firmware file of solved positions both AIs play from before "
+                 "searching, e.g. " TABLEBASE_FILE);
+
 /* Declare kernel module attribute for sysfs */
 
 struct kxo_attr {
@@ -83,7 +137,7 @@ static int major;
 static struct class *kxo_class;
 static struct cdev kxo_cdev;
 
-static char table[N_GRIDS];
+static board_t board;
 static u8 last_move;
 
 // static char table_buffer[N_GRIDS];
@@ -100,20 +154,27 @@ static DEFINE_MUTEX(read_lock);
 /* Wait queue to implement blocking I/O from userspace */
 static DECLARE_WAIT_QUEUE_HEAD(rx_wait);
 
-static uint32_t compress_table(const char *table)
+/* Interleave a zero bit above every bit of a 16-bit mask */
+static inline uint32_t spread_bits(uint16_t mask)
 {
-    uint32_t bits = 0;
-    for (int i = 0; i < N_GRIDS; i++) {
-        uint32_t v = (table[i] == ' ') ? 0 : (table[i] == 'O' ? 1 : 2);
-        bits |= (v & 0x3) << (i * 2);
-    }
+    uint32_t bits = mask;
+    bits = (bits | (bits << 8)) & 0x00FF00FF;
+    bits = (bits | (bits << 4)) & 0x0F0F0F0F;
+    bits = (bits | (bits << 2)) & 0x33333333;
+    bits = (bits | (bits << 1)) & 0x55555555;
     return bits;
 }
 
+/* Pack the board as 2 bits per grid: 0 for ' ', 1 for 'O', 2 for 'X' */
+static uint32_t compress_table(const board_t *board)
+{
+    return spread_bits(board->mask[0]) | (spread_bits(board->mask[1]) << 1);
+}
+
 static void produce_compressed_board(void)
 {
     struct kxo_frame frame = {
-        .compressed_table = compress_table(table),
+        .compressed_table = compress_table(&board),
         .last_move = last_move,
     };
     unsigned int len =
@@ -179,9 +240,219 @@ static void drawboard_work_func(struct work_struct *w)
     wake_up_interruptible(&rx_wait);
 }
 
+/* Workqueue for asynchronous bottom-half processing */
+static struct workqueue_struct *kxo_workqueue;
+
 static char turn;
 static int finish;
 
+/* Root parallelism for MCTS: every worker runs an independent search with
+ * its own tree and xoroshiro stream, and the move with the most root visits
+ * summed over all workers is played. With mcts_shared_tree set, the workers
+ * instead grow the tree of the first worker together (tree parallelism),
+ * each still drawing from its own stream, so only the first worker needs
+ * an arena. The others get theirs from mcts_workers_setup() once a move is
+ * searched with root parallelism.
+ */
+struct mcts_worker {
+    struct work_struct work;
+    struct mcts_info info;
+    struct mcts_info *shared;
+    board_t board;
+    char player;
+    int budget_us;
+    int visits[N_GRIDS];
+    int iterations;
+    s64 nsecs;
+};
+
+static struct mcts_worker *mcts_workers;
+
+static void mcts_work_func(struct work_struct *w)
+{
+    struct mcts_worker *worker = container_of(w, struct mcts_worker, work);
+    ktime_t tv_start = ktime_get();
+
+    if (worker->shared)
+        worker->iterations =
+            mcts_worker(worker->shared, &worker->info.xoro_obj,
+                        DIV_ROUND_UP(ITERATIONS, mcts_threads));
+    else
+        worker->iterations =
+            mcts_search(&worker->info, &worker->board, worker->player,
+                        worker->budget_us, worker->visits);
+    worker->nsecs = (s64) ktime_to_ns(ktime_sub(ktime_get(), tv_start));
+}
+
+/* Give worker i an arena of its own, in the modes chosen at load time */
+static int mcts_worker_setup(int i)
+{
+    struct mcts_info *info = &mcts_workers[i].info;
+    int ret = mcts_info_init(info, mcts_arena_nodes, i);
+
+    if (!ret && mcts_dag)
+        ret = mcts_info_enable_dag(info);
+    else if (!ret && mcts_rave)
+        ret = mcts_info_enable_rave(info);
+    if (ret)
+        mcts_info_exit(info);
+    return ret;
+}
+
+/* Number of workers ready for root parallelism: all of them, or only the
+ * first one when the others cannot get an arena
+ */
+static int mcts_workers_setup(void)
+{
+    for (int i = 1; i < mcts_threads; i++) {
+        if (!mcts_workers[i].info.arena && mcts_worker_setup(i))
+            return 1;
+    }
+    return mcts_threads;
+}
+
+static int mcts_parallel(const board_t *board, char player, int *iterations)
+{
+    int budget_us = READ_ONCE(mcts_budget_us);
+    struct mcts_info *shared = NULL;
+    int visits[N_GRIDS] = {0};
+    ktime_t tv_start = ktime_get();
+    s64 busy = 0, nsecs;
+    int n_workers = mcts_threads;
+
+    if (READ_ONCE(mcts_shared_tree) && !mcts_dag && !mcts_rave) {
+        shared = &mcts_workers[0].info;
+        mcts_begin(shared, board, player, budget_us);
+    } else {
+        n_workers = mcts_workers_setup();
+    }
+    for (int i = 0; i < n_workers; i++) {
+        mcts_workers[i].shared = shared;
+        mcts_workers[i].board = *board;
+        mcts_workers[i].player = player;
+        mcts_workers[i].budget_us = budget_us;
+    }
+    for (int i = 1; i < n_workers; i++)
+        queue_work(kxo_workqueue, &mcts_workers[i].work);
+    mcts_work_func(&mcts_workers[0].work);
+
+    *iterations = 0;
+    for (int i = 0; i < n_workers; i++) {
+        if (i)
+            flush_work(&mcts_workers[i].work);
+        for (int j = 0; !shared && j < N_GRIDS; j++)
+            visits[j] += mcts_workers[i].visits[j];
+        *iterations += mcts_workers[i].iterations;
+        busy += mcts_workers[i].nsecs;
+    }
+    if (shared)
+        mcts_end(shared, visits);
+
+    nsecs = (s64) ktime_to_ns(ktime_sub(ktime_get(), tv_start));
+    if (n_workers > 1 && nsecs > 0) {
+        u64 speedup = div64_u64((u64) busy * 100, (u64) nsecs);
+        pr_info("kxo: mcts: %d workers (%s), speedup %llu.%02llux\n",
+                n_workers, shared ? "shared tree" : "root", speedup / 100,
+                speedup % 100);
+    }
+    return mcts_best_move(visits);
+}
+
+static void mcts_workers_exit(void)
+{
+    if (!mcts_workers)
+        return;
+    for (int i = 0; i < mcts_threads; i++)
+        mcts_info_exit(&mcts_workers[i].info);
+    kfree(mcts_workers);
+    mcts_workers = NULL;
+}
+
+static int mcts_workers_init(void)
+{
+    if (mcts_threads < 1)
+        mcts_threads = 1;
+    mcts_workers =
+        kcalloc(mcts_threads, sizeof(struct mcts_worker), GFP_KERNEL);
+    if (!mcts_workers)
+        return -ENOMEM;
+
+    for (int i = 0; i < mcts_threads; i++) {
+        INIT_WORK(&mcts_workers[i].work, mcts_work_func);
+        xoro_init_stream(&mcts_workers[i].info.xoro_obj, i);
+    }
+    int ret = mcts_worker_setup(0);
+    if (ret)
+        mcts_workers_exit();
+    return ret;
+}
+
+struct negamax_helper {
+    struct work_struct work;
+    struct negamax_context ctx;
+    int depth;
+};
+
+static struct negamax_helper *negamax_helper_works;
+static int negamax_stop;
+
+static void negamax_helper_func(struct work_struct *w)
+{
+    struct negamax_helper *helper =
+        container_of(w, struct negamax_helper, work);
+
+    negamax_search_depth(&helper->ctx, helper->depth);
+}
+
+/* Lazy SMP: the helpers search the position on other CPUs until the main
+ * search, run here, is done, and only share their results with it through
+ * the transposition table
+ */
+static move_t negamax_parallel(const board_t *board, char player)
+{
+    int depth = READ_ONCE(negamax_depth);
+    struct negamax_context ctx;
+    move_t result;
+
+    /* Shallower searches do not even try a move, and deeper ones only add
+     * empty deepening steps and overflow the depth kept in the TT
+     */
+    depth = clamp(depth, 2, N_GRIDS);
+    /* Start the generation before any helper stores an entry in it */
+    zobrist_clear();
+    WRITE_ONCE(negamax_stop, 0);
+    for (int i = 0; i < negamax_helpers; i++) {
+        struct negamax_helper *helper = &negamax_helper_works[i];
+        negamax_context_init(&helper->ctx, board, player);
+        negamax_context_helper(&helper->ctx, i + 1, &negamax_stop);
+        helper->depth = depth;
+        queue_work(kxo_workqueue, &helper->work);
+    }
+
+    negamax_context_init(&ctx, board, player);
+    result = negamax_search_depth(&ctx, depth);
+
+    WRITE_ONCE(negamax_stop, 1);
+    for (int i = 0; i < negamax_helpers; i++)
+        flush_work(&negamax_helper_works[i].work);
+    return result;
+}
+
+static int negamax_helpers_init(void)
+{
+    if (negamax_helpers < 0)
+        negamax_helpers = 0;
+    if (!negamax_helpers)
+        return 0;
+    negamax_helper_works = kcalloc(negamax_helpers,
+                                   sizeof(struct negamax_helper), GFP_KERNEL);
+    if (!negamax_helper_works)
+        return -ENOMEM;
+    for (int i = 0; i < negamax_helpers; i++)
+        INIT_WORK(&negamax_helper_works[i].work, negamax_helper_func);
+    return 0;
+}
+
 static void ai_one_work_func(struct work_struct *w)
 {
     ktime_t tv_start, tv_end;
@@ -192,17 +463,25 @@ static void ai_one_work_func(struct work_struct *w)
     WARN_ON_ONCE(in_softirq());
     WARN_ON_ONCE(in_interrupt());
 
+    /* The search sleeps while waiting for the other MCTS workers, so
+     * preemption is only disabled around the per-CPU log.
+     */
     cpu = get_cpu();
     pr_info("kxo: [CPU#%d] start doing %s\n", cpu, __func__);
+    put_cpu();
     tv_start = ktime_get();
     mutex_lock(&producer_lock);
-    int move;
-    WRITE_ONCE(move, mcts(table, 'O'));
+    int move, iterations = 0;
+    WRITE_ONCE(move, book_probe(&board, 'O'));
+    if (move == -1)
+        WRITE_ONCE(move, tablebase_probe(&board, 'O', NULL));
+    if (move == -1)
+        WRITE_ONCE(move, mcts_parallel(&board, 'O', &iterations));
 
     smp_mb();
 
     if (move != -1)
-        WRITE_ONCE(table[move], 'O');
+        board_play(&board, move, 'O');
 
     WRITE_ONCE(turn, 'X');
     WRITE_ONCE(finish, 1);
@@ -212,9 +491,8 @@ static void ai_one_work_func(struct work_struct *w)
     tv_end = ktime_get();
 
     nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
-    pr_info("kxo: [CPU#%d] %s completed in %llu usec\n", cpu, __func__,
-            (unsigned long long) nsecs >> 10);
-    put_cpu();
+    pr_info("kxo: [CPU#%d] %s completed in %llu usec, %d iterations\n", cpu,
+            __func__, (unsigned long long) nsecs >> 10, iterations);
 }
 
 static void ai_two_work_func(struct work_struct *w)
@@ -227,17 +505,25 @@ static void ai_two_work_func(struct work_struct *w)
     WARN_ON_ONCE(in_softirq());
     WARN_ON_ONCE(in_interrupt());
 
+    /* Lazy SMP waits for the helper searches, so preemption is only
+     * disabled around the per-CPU log.
+     */
     cpu = get_cpu();
     pr_info("kxo: [CPU#%d] start doing %s\n", cpu, __func__);
+    put_cpu();
     tv_start = ktime_get();
     mutex_lock(&producer_lock);
     int move;
-    WRITE_ONCE(move, negamax_predict(table, 'X').move);
+    WRITE_ONCE(move, book_probe(&board, 'X'));
+    if (move == -1)
+        WRITE_ONCE(move, tablebase_probe(&board, 'X', NULL));
+    if (move == -1)
+        WRITE_ONCE(move, negamax_parallel(&board, 'X').move);
 
     smp_mb();
 
     if (move != -1)
-        WRITE_ONCE(table[move], 'X');
+        board_play(&board, move, 'X');
 
     WRITE_ONCE(turn, 'O');
     WRITE_ONCE(finish, 1);
@@ -249,12 +535,8 @@ static void ai_two_work_func(struct work_struct *w)
     nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
     pr_info("kxo: [CPU#%d] %s completed in %llu usec\n", cpu, __func__,
             (unsigned long long) nsecs >> 10);
-    put_cpu();
 }
 
-/* Workqueue for asynchronous bottom-half processing */
-static struct workqueue_struct *kxo_workqueue;
-
 /* Work item: holds a pointer to the function that is going to be executed
  * asynchronously.
  */
@@ -328,7 +610,7 @@ static void timer_handler(struct timer_list *__timer)
 
     tv_start = ktime_get();
 
-    char win = check_win(table);
+    char win = check_win(&board);
 
     if (win == ' ') {
         ai_game();
@@ -349,7 +631,7 @@ static void timer_handler(struct timer_list *__timer)
 
 
             struct kxo_frame end_frame = {
-                .compressed_table = compress_table(table),
+                .compressed_table = compress_table(&board),
                 .last_move = 17,
             };
             mutex_lock(&producer_lock);
@@ -363,8 +645,7 @@ static void timer_handler(struct timer_list *__timer)
         }
 
         if (attr_obj.end == '0') {
-            memset(table, ' ',
-                   N_GRIDS); /* Reset the table so the game restart */
+            board_init(&board); /* Reset the board so the game restart */
             mod_timer(&timer, jiffies + msecs_to_jiffies(delay));
         }
 
@@ -511,9 +792,23 @@ static int __init kxo_init(void)
         goto error_workqueue;
     }
 
-    negamax_init();
-    mcts_init();
-    memset(table, ' ', N_GRIDS);
+    game_init();
+    ret = negamax_init(negamax_tt_kb, 0);
+    if (ret)
+        goto error_negamax;
+    ret = negamax_helpers_init();
+    if (ret)
+        goto error_helpers;
+    ret = mcts_workers_init();
+    if (ret)
+        goto error_mcts;
+    if (tablebase && *tablebase) {
+        int err = tablebase_load(kxo_dev, tablebase);
+        if (err)
+            pr_warn("kxo: no tablebase from %s (%d), searching instead\n",
+                    tablebase, err);
+    }
+    board_init(&board);
     turn = 'O';
     finish = 1;
 
@@ -528,6 +823,12 @@ static int __init kxo_init(void)
     pr_info("kxo: registered new kxo device: %d,%d\n", major, 0);
 out:
     return ret;
+error_mcts:
+    kfree(negamax_helper_works);
+error_helpers:
+    negamax_exit();
+error_negamax:
+    destroy_workqueue(kxo_workqueue);
 error_workqueue:
     vfree(fast_buf.buf);
 error_vmalloc:
@@ -551,6 +852,10 @@ static void __exit kxo_exit(void)
     tasklet_kill(&game_tasklet);
     flush_workqueue(kxo_workqueue);
     destroy_workqueue(kxo_workqueue);
+    tablebase_unload();
+    mcts_workers_exit();
+    kfree(negamax_helper_works);
+    negamax_exit();
     vfree(fast_buf.buf);
     device_destroy(kxo_class, dev_id);
     class_destroy(kxo_class);
@@ -1,218 +1,981 @@
-#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/overflow.h>
 #include <linux/string.h>
+#include <linux/vmalloc.h>
 
 #include "game.h"
 #include "mcts.h"
+#include "rollout.h"
 #include "util.h"
+#include "zobrist.h"
 
+/* Nodes live in a per-search arena and refer to each other by 32-bit
+ * arena index. The children of a node are allocated as one contiguous run
+ * starting at first_child, and the statistics read by uct_score() come
+ * first, so scanning the children of a parent walks consecutive 16-byte
+ * slots instead of chasing pointers. The path from the root is kept on the
+ * stack during descent, so no parent link is stored. The root always sits
+ * at index 0, so first_child == 0 means the node is not expanded yet.
+ */
 struct node {
-    int move;
+    int n_visits;
+    fixed_point_t score;
+    uint32_t first_child;
+    uint8_t n_children;
+    int8_t move;
     char player;
+    int8_t proof;
+};
+
+/* MCTS-Solver: the game-theoretic value of a node once it is known, seen
+ * like its score from the player who moved into it. A terminal node is
+ * proven when it is first reached, and a parent is proven lost as soon as
+ * one child is proven won, or once all of its children are proven, with the
+ * value of the best of them. Proven nodes are not searched again: a visit
+ * backs up their exact value, and selection skips the children proven lost.
+ */
+#define PROOF_NONE 0
+#define PROOF_LOSS 1
+#define PROOF_DRAW 2
+#define PROOF_WIN 3
+#define PROOF_NEGATE(proof) (PROOF_LOSS + PROOF_WIN - (proof))
+
+/* RAVE mode: the all-moves-as-first statistics of arena[i], seen from the
+ * same player as its score, are kept in amaf[i]: the playouts through its
+ * parent in which its move was played by that player at any later point.
+ */
+struct amaf {
     int n_visits;
     fixed_point_t score;
-    struct node *parent;
-    struct node *children[N_GRIDS];
 };
 
-static struct mcts_info mcts_obj;
+/* Tree-parallel workers share one tree: statistics and the arena index are
+ * updated with atomic operations, a node is expanded by the worker that
+ * swaps its first_child from 0 to NODE_EXPANDING, and the children are
+ * published by a release store of the real first_child.
+ */
+#define NODE_EXPANDING (~0U)
 
-static struct node *new_node(int move, char player, struct node *parent)
+static inline int fetch_add(int *p, int v)
 {
-    struct node *node = kzalloc(sizeof(struct node), GFP_KERNEL);
-    node->move = move;
-    node->player = player;
-    node->n_visits = 0;
-    node->score = 0;
-    node->parent = parent;
-    memset(node->children, 0, sizeof(node->children));
-    return node;
+    return atomic_fetch_add(v, (atomic_t *) p);
 }
 
-static void free_node(struct node *node)
+static inline bool claim_expansion(struct node *node)
 {
-    for (int i = 0; i < N_GRIDS; i++)
-        if (node->children[i])
-            free_node(node->children[i]);
-    kfree(node);
+    return cmpxchg(&node->first_child, 0, NODE_EXPANDING) == 0;
 }
 
-static fixed_point_t fixed_sqrt(fixed_point_t x)
+#define load_stat(x) READ_ONCE(x)
+#define store_stat(x, v) WRITE_ONCE(x, v)
+#define load_first_child(node) smp_load_acquire(&(node)->first_child)
+#define publish_children(node, first) \
+    smp_store_release(&(node)->first_child, (first))
+
+/* Allocation takes the next n free slots of the arena and the whole tree is
+ * released at once by arena_reset().
+ */
+static struct node *arena_alloc(struct mcts_info *obj, int n, bool shared)
 {
-    if (!x || x == (1U << FIXED_SCALE_BITS))
-        return x;
+    int used;
 
-    fixed_point_t s = 0U;
-    for (int i = (31 - __builtin_clz(x | 1)); i >= 0; i--) {
-        fixed_point_t t = (1U << i);
-        if ((((s + t) * (s + t)) >> FIXED_SCALE_BITS) <= x)
-            s += t;
+    if (shared) {
+        used = fetch_add(&obj->arena_used, n);
+        if (obj->arena_size - used < n)
+            return NULL;
+    } else {
+        used = obj->arena_used;
+        if (obj->arena_size - used < n)
+            return NULL;
+        obj->arena_used += n;
     }
-    return s;
+    return &obj->arena[used];
 }
 
-static fixed_point_t fixed_log(fixed_point_t v)
+/* Track the largest tree a search has needed, as a hint for sizing
+ * mcts_arena_nodes. Every worker reaches new peaks early on, so this only
+ * goes to the debug log.
+ */
+static void arena_track(struct mcts_info *obj)
 {
-    if (!v || v == (1U << FIXED_SCALE_BITS))
-        return 0;
+    if (obj->arena_used > obj->arena_size)
+        obj->arena_used = obj->arena_size;
+    if (obj->arena_used > obj->arena_high_water) {
+        obj->arena_high_water = obj->arena_used;
+        pr_debug("kxo: mcts arena high-water mark: %d/%d nodes\n",
+                 obj->arena_high_water, obj->arena_size);
+    }
+}
+
+static void arena_reset(struct mcts_info *obj)
+{
+    obj->arena_used = 0;
+    obj->tree_valid = 0;
+}
+
+static void init_node(struct node *node, int move, char player)
+{
+    node->n_visits = 0;
+    node->score = 0;
+    node->first_child = 0;
+    node->n_children = 0;
+    node->move = move;
+    node->player = player;
+    node->proof = PROOF_NONE;
+}
 
-    fixed_point_t numerator = (v - (1U << FIXED_SCALE_BITS));
-    int neg = 0;
-    if (GET_SIGN(numerator)) {
-        neg = 1;
-        numerator = CLR_SIGN(numerator);
-        numerator = (1U << 31) - numerator;
+/* UCT is evaluated in its own fixed point with UCT_SCALE_BITS fractional
+ * bits. For every visit count n below UCT_TABLE_SIZE, uct_init() stores
+ *   uct_recip[n]    = 2^31 / n,
+ *   uct_inv_sqrt[n] = 1 / sqrt(n),
+ *   uct_explore[n]  = sqrt(2 ln n),
+ * so selection needs neither a division nor a series expansion: the mean
+ * score of a child is a multiplication by uct_recip[] and the exploration
+ * term is the parent's uct_explore[] times the child's uct_inv_sqrt[]. Larger
+ * counts are scaled down by an even power of 2 into the table, except for
+ * the exploration factor of a parent, which is then computed once per
+ * select_move() call.
+ */
+#define UCT_SCALE_BITS 16
+#define UCT_TABLE_SIZE 2048
+#define UCT_LN2 45426 /* ln(2) << UCT_SCALE_BITS */
+
+/* RAVE weighs the AMAF value of a child by
+ *   beta(n) = sqrt(RAVE_EQUIV / (3 n + RAVE_EQUIV)),
+ * which falls from 1 towards 0 as the child gets visits, passing 1/2 at
+ * n = RAVE_EQUIV. rave_beta[] holds it in UCT fixed point.
+ */
+#define RAVE_EQUIV 20
+
+static uint32_t uct_recip[UCT_TABLE_SIZE];
+static uint32_t uct_inv_sqrt[UCT_TABLE_SIZE];
+static uint32_t uct_explore[UCT_TABLE_SIZE];
+static uint32_t rave_beta[UCT_TABLE_SIZE];
+
+static uint32_t uct_sqrt(uint64_t x)
+{
+    uint64_t res = 0, bit = 1ULL << 62;
+
+    while (bit > x)
+        bit >>= 2;
+    for (; bit; bit >>= 2) {
+        if (x >= res + bit) {
+            x -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
     }
+    return res;
+}
 
-    fixed_point_t y =
-        (numerator << FIXED_SCALE_BITS) / (v + (1U << FIXED_SCALE_BITS));
+/* ln(x) for x >= 1: the integer part of log2(x) comes from the highest set
+ * bit, and each fractional bit from squaring the mantissa in [1, 2).
+ */
+static uint32_t uct_ln(uint32_t x)
+{
+    int ip = 31 - __builtin_clz(x);
+    uint64_t m = (uint64_t) x << (30 - ip);
+    uint32_t log2 = ip << UCT_SCALE_BITS;
 
-    fixed_point_t ans = 0U;
-    for (unsigned i = 1; i < 20; i += 2) {
-        fixed_point_t z = (1U << FIXED_SCALE_BITS);
-        for (int j = 0; j < i; j++) {
-            z *= y;
-            z >>= FIXED_SCALE_BITS;
+    for (int i = UCT_SCALE_BITS - 1; i >= 0; i--) {
+        m = (m * m) >> 30;
+        if (m >= (1ULL << 31)) {
+            m >>= 1;
+            log2 |= 1U << i;
         }
-        z <<= FIXED_SCALE_BITS;
-        z /= (i << FIXED_SCALE_BITS);
+    }
+    return ((uint64_t) log2 * UCT_LN2) >> UCT_SCALE_BITS;
+}
+
+static uint32_t rave_weight(int n_visits)
+{
+    uint32_t beta2 = (RAVE_EQUIV << UCT_SCALE_BITS) /
+                     (3U * n_visits + RAVE_EQUIV);
+    return uct_sqrt((uint64_t) beta2 << UCT_SCALE_BITS);
+}
 
-        ans += z;
+static void uct_init(void)
+{
+    for (int n = 1; n < UCT_TABLE_SIZE; n++) {
+        uct_recip[n] = (1U << 31) / n;
+        uct_inv_sqrt[n] = uct_sqrt((uint64_t) uct_recip[n] << 1);
+        uct_explore[n] = uct_sqrt((uint64_t) uct_ln(n)
+                                  << (UCT_SCALE_BITS + 1));
+        rave_beta[n] = rave_weight(n);
     }
-    ans <<= 1;
-    ans = neg ? SET_SIGN(ans) : ans;
-    return ans;
 }
 
-#define EXPLORATION_FACTOR fixed_sqrt(1U << (FIXED_SCALE_BITS + 1))
+static inline uint32_t parent_explore(int n_total)
+{
+    if (n_total < UCT_TABLE_SIZE)
+        return uct_explore[n_total];
+    return uct_sqrt((uint64_t) uct_ln(n_total) << (UCT_SCALE_BITS + 1));
+}
+
+static inline int uct_shift(int n_visits)
+{
+    int shift = 0;
+    while ((n_visits >> shift) >= UCT_TABLE_SIZE)
+        shift += 2;
+    return shift;
+}
+
+/* Mean of a score summed over n_visits > 0 playouts */
+static inline uint32_t uct_mean(fixed_point_t score, int n_visits)
+{
+    int shift = uct_shift(n_visits);
+    return ((uint64_t) score * uct_recip[n_visits >> shift]) >>
+           (31 - UCT_SCALE_BITS + FIXED_SCALE_BITS + shift);
+}
 
-static inline fixed_point_t uct_score(int n_total,
-                                      int n_visits,
-                                      fixed_point_t score)
+static inline uint32_t uct_bonus(uint32_t explore, int n_visits)
+{
+    int shift = uct_shift(n_visits);
+    return ((uint64_t) explore * uct_inv_sqrt[n_visits >> shift]) >>
+           (UCT_SCALE_BITS + shift / 2);
+}
+
+static inline uint32_t uct_score(uint32_t explore,
+                                 int n_visits,
+                                 fixed_point_t score)
 {
     if (n_visits == 0)
         return FIXED_MAX;
-
-    fixed_point_t result =
-        score << FIXED_SCALE_BITS /
-                     (fixed_point_t) (n_visits << FIXED_SCALE_BITS);
-    fixed_point_t tmp =
-        EXPLORATION_FACTOR *
-        fixed_sqrt(fixed_log(n_total << FIXED_SCALE_BITS) / n_visits);
-    tmp >>= FIXED_SCALE_BITS;
-    return result + tmp;
+    return uct_mean(score, n_visits) + uct_bonus(explore, n_visits);
 }
 
-static struct node *select_move(struct node *node)
+static struct node *select_move(struct mcts_info *obj,
+                                const struct node *node,
+                                uint32_t first_child)
 {
-    struct node *best_node = NULL;
+    struct node *child = &obj->arena[first_child];
+    struct node *best_node = child;
     fixed_point_t best_score = 0U;
-    for (int i = 0; i < N_GRIDS; i++) {
-        if (!node->children[i])
+    uint32_t explore = parent_explore(load_stat(node->n_visits));
+    for (int i = 0; i < node->n_children; i++, child++) {
+        if (load_stat(child->proof) == PROOF_LOSS)
             continue;
-        fixed_point_t score =
-            uct_score(node->n_visits, node->children[i]->n_visits,
-                      node->children[i]->score);
+        fixed_point_t score = uct_score(explore, load_stat(child->n_visits),
+                                        load_stat(child->score));
         if (score > best_score) {
             best_score = score;
-            best_node = node->children[i];
+            best_node = child;
         }
     }
     return best_node;
 }
 
-static fixed_point_t simulate(const char *table, char player)
+/* Add a playout scoring score to every node on the path. The score of a
+ * node is seen by the player who moved into it, so it is flipped at every
+ * level. In a shared tree the visit was already counted on the way down
+ * (the virtual loss), so only the score is added here.
+ */
+static void backpropagate(struct node **path,
+                          int depth,
+                          fixed_point_t score,
+                          bool shared)
+{
+    for (; depth >= 0; depth--) {
+        if (shared) {
+            fetch_add((int *) &path[depth]->score, score);
+        } else {
+            path[depth]->n_visits++;
+            path[depth]->score += score;
+        }
+        score = (1U << FIXED_SCALE_BITS) - score;
+    }
+}
+
+/* DAG mode: transposed positions share one node. A node is found through an
+ * open-addressed table keyed by the Zobrist hash of its position and side
+ * to move (see zobrist_side), as the DAG outlives games that do not all
+ * start with the same side. The children of an expanded node are a run of
+ * n_children edges starting at edges[first_child], each holding a node
+ * index and the move leading to it. Slot 0 of the arena and of the edges
+ * is never used, so node 0 marks an empty table slot and first_child 0 an
+ * unexpanded node as in tree mode.
+ */
+#define EDGE_MOVE_BITS 4
+#define EDGE(node, move) (((node) << EDGE_MOVE_BITS) | (move))
+#define EDGE_NODE(edge) ((edge) >> EDGE_MOVE_BITS)
+#define EDGE_MOVE(edge) ((edge) & ((1U << EDGE_MOVE_BITS) - 1))
+
+/* Child i of an expanded node, in either mode */
+static inline const struct node *child_node(const struct mcts_info *obj,
+                                            const struct node *parent,
+                                            int i)
+{
+    if (obj->dag)
+        return &obj->arena[EDGE_NODE(obj->edges[parent->first_child + i])];
+    return &obj->arena[parent->first_child + i];
+}
+
+static inline fixed_point_t proof_score(int proof)
+{
+    return (proof - PROOF_LOSS) << (FIXED_SCALE_BITS - 1);
+}
+
+/* path[depth] has just been proven: prove its ancestors as far as that
+ * decides them. Proofs never change once set, so workers sharing a tree may
+ * race here and still agree. In DAG mode only the ancestors on this path
+ * are reached; the other parents of a shared node catch up when a later
+ * descent meets the proof.
+ */
+static void solve(const struct mcts_info *obj, struct node **path, int depth)
+{
+    for (; depth > 0; depth--) {
+        struct node *parent = path[depth - 1];
+        int proof = load_stat(path[depth]->proof);
+
+        if (proof != PROOF_WIN) {
+            for (int i = 0; i < parent->n_children; i++) {
+                int p = load_stat(child_node(obj, parent, i)->proof);
+                if (p == PROOF_NONE)
+                    return;
+                if (p > proof)
+                    proof = p;
+            }
+        }
+        store_stat(parent->proof, PROOF_NEGATE(proof));
+    }
+}
+
+/* Prove a terminal node, won by the player who moved into it or drawn */
+static void prove_terminal(const struct mcts_info *obj,
+                           struct node **path,
+                           int depth,
+                           char win)
+{
+    store_stat(path[depth]->proof, win == 'D' ? PROOF_DRAW : PROOF_WIN);
+    solve(obj, path, depth);
+}
+
+/* The moves a node is expanded with. Moves that a symmetry of the board
+ * maps onto each other lead to equivalent positions, so the root only gets
+ * one of each, which leaves 3 first moves out of 16 on the empty board.
+ */
+static int node_moves(const struct mcts_info *obj,
+                      const struct node *node,
+                      const board_t *board,
+                      int *moves)
+{
+    if (node == &obj->arena[obj->root])
+        return unique_moves(board, moves);
+    return available_moves(board, moves);
+}
+
+static int expand(struct mcts_info *obj,
+                  struct node *node,
+                  const board_t *board,
+                  bool shared)
+{
+    int moves[N_GRIDS];
+    int n_moves = node_moves(obj, node, board, moves);
+    struct node *children = n_moves ? arena_alloc(obj, n_moves, shared) : NULL;
+    if (!children) {
+        if (shared)
+            publish_children(node, 0);
+        return 0;
+    }
+
+    for (int i = 0; i < n_moves; i++)
+        init_node(&children[i], moves[i], node->player ^ 'O' ^ 'X');
+    if (obj->amaf)
+        memset(&obj->amaf[children - obj->arena], 0,
+               n_moves * sizeof(struct amaf));
+    node->n_children = n_moves;
+    if (shared)
+        publish_children(node, children - obj->arena);
+    else
+        node->first_child = children - obj->arena;
+    return n_moves;
+}
+
+/* One selection, expansion, simulation and backpropagation pass, returning
+ * the number of playouts done. With shared set, several workers run this
+ * concurrently on the same tree: every node on the path takes a visit as it
+ * is selected so that other workers are steered elsewhere until the result
+ * is backed up, and a node being expanded by another worker is simulated as
+ * a leaf.
+ */
+static __always_inline int iterate(struct mcts_info *obj,
+                                    struct state_array *xoro,
+                                    bool shared)
+{
+    struct node *path[N_GRIDS + 1];
+    int depth = 0;
+    struct node *node = path[0] = &obj->arena[0];
+    board_t temp_board = obj->root_board;
+    char win = obj->root_win;
+    fixed_point_t score;
+
+    while (1) {
+        int n_visits =
+            shared ? fetch_add(&node->n_visits, 1) : node->n_visits;
+        int proof = load_stat(node->proof);
+        if (proof != PROOF_NONE) {
+            backpropagate(path, depth, proof_score(proof), shared);
+            return 1;
+        }
+        if (win != ' ') {
+            if (depth)
+                prove_terminal(obj, path, depth, win);
+            score = calculate_win_value(win, node->player ^ 'O' ^ 'X');
+            backpropagate(path, depth, score, shared);
+            return 1;
+        }
+        if (n_visits == 0) {
+            score = rollout(xoro, &temp_board, node->player);
+            backpropagate(path, depth, score, shared);
+            return 1;
+        }
+
+        uint32_t first_child =
+            shared ? load_first_child(node) : node->first_child;
+        if (!first_child && (!shared || claim_expansion(node))) {
+            expand(obj, node, &temp_board, shared);
+            first_child = node->first_child;
+        }
+        if (!first_child || first_child == NODE_EXPANDING) {
+            /* Arena exhausted or expansion in progress: sample this leaf */
+            score = rollout(xoro, &temp_board, node->player);
+            backpropagate(path, depth, score, shared);
+            return 1;
+        }
+
+        node = path[++depth] = select_move(obj, node, first_child);
+        board_play(&temp_board, node->move, node->player ^ 'O' ^ 'X');
+        win = check_win_after(&temp_board, node->move);
+    }
+}
+
+static inline uint32_t rave_score(uint32_t explore,
+                                  const struct node *child,
+                                  const struct amaf *amaf)
+{
+    uint32_t beta, value;
+
+    if (child->n_visits == 0)
+        return FIXED_MAX;
+    value = uct_mean(child->score, child->n_visits);
+    if (amaf->n_visits) {
+        beta = child->n_visits < UCT_TABLE_SIZE ? rave_beta[child->n_visits]
+                                                : rave_weight(child->n_visits);
+        value = (((uint64_t) ((1U << UCT_SCALE_BITS) - beta) * value) +
+                 (uint64_t) beta * uct_mean(amaf->score, amaf->n_visits)) >>
+                UCT_SCALE_BITS;
+    }
+    return value + uct_bonus(explore, child->n_visits);
+}
+
+static struct node *rave_select(struct mcts_info *obj, const struct node *node)
+{
+    struct node *child = &obj->arena[node->first_child];
+    const struct amaf *amaf = &obj->amaf[node->first_child];
+    struct node *best_node = child;
+    uint32_t best_score = 0U;
+    uint32_t explore = parent_explore(node->n_visits);
+    for (int i = 0; i < node->n_children; i++, child++, amaf++) {
+        if (child->proof == PROOF_LOSS)
+            continue;
+        uint32_t score = rave_score(explore, child, amaf);
+        if (score > best_score) {
+            best_score = score;
+            best_node = child;
+        }
+    }
+    return best_node;
+}
+
+/* Credit the result to every child of a node on the path whose move was
+ * played, by the player to move at that node, later in the iteration.
+ */
+static void rave_update(struct mcts_info *obj,
+                        struct node **path,
+                        int depth,
+                        fixed_point_t score,
+                        const board_t *final)
+{
+    for (; depth >= 0; depth--) {
+        const struct node *node = path[depth];
+        uint16_t played = final->mask[PLAYER_ID(node->player)];
+        const struct node *child = &obj->arena[node->first_child];
+        struct amaf *amaf = &obj->amaf[node->first_child];
+
+        score = (1U << FIXED_SCALE_BITS) - score;
+        for (int i = 0; node->first_child && i < node->n_children;
+             i++, child++, amaf++) {
+            if (played & (1U << child->move)) {
+                amaf->n_visits++;
+                amaf->score += score;
+            }
+        }
+    }
+}
+
+/* iterate() in RAVE mode, always with a single playout per leaf */
+static int iterate_rave(struct mcts_info *obj, struct state_array *xoro)
 {
-    char current_player = player;
-    char temp_table[N_GRIDS];
-    memcpy(temp_table, table, N_GRIDS);
-    xoro_jump(&(mcts_obj.xoro_obj));
+    struct node *path[N_GRIDS + 1];
+    int depth = 0;
+    struct node *node = path[0] = &obj->arena[0];
+    board_t temp_board = obj->root_board, final;
+    char win = obj->root_win;
+    fixed_point_t score;
+
     while (1) {
-        int *moves = available_moves(temp_table);
-        if (moves[0] == -1) {
-            kfree(moves);
+        if (node->proof != PROOF_NONE) {
+            score = proof_score(node->proof);
+            final = temp_board;
+            break;
+        }
+        if (win != ' ') {
+            if (depth)
+                prove_terminal(obj, path, depth, win);
+            score = calculate_win_value(win, node->player ^ 'O' ^ 'X');
+            final = temp_board;
+            break;
+        }
+        if (node->n_visits == 0 ||
+            (!node->first_child && !expand(obj, node, &temp_board, false))) {
+            score = rollout_final(xoro, &temp_board, node->player, &final);
             break;
         }
-        int n_moves = 0;
-        while (n_moves < N_GRIDS && moves[n_moves] != -1)
-            ++n_moves;
-        int move = moves[xoro_next(&(mcts_obj.xoro_obj)) % n_moves];
-        kfree(moves);
-        temp_table[move] = current_player;
-        char win;
-        if ((win = check_win(temp_table)) != ' ')
-            return calculate_win_value(win, player);
-        current_player ^= 'O' ^ 'X';
+
+        node = path[++depth] = rave_select(obj, node);
+        board_play(&temp_board, node->move, node->player ^ 'O' ^ 'X');
+        win = check_win_after(&temp_board, node->move);
     }
-    return (fixed_point_t) (1UL << (FIXED_SCALE_BITS - 1));
+    backpropagate(path, depth, score, false);
+    rave_update(obj, path, depth, score, &final);
+    return 1;
 }
 
-static void backpropagate(struct node *node, fixed_point_t score)
+struct dag_slot {
+    u64 key;
+    uint32_t node;
+};
+
+static void dag_reset(struct mcts_info *obj)
 {
-    while (node) {
-        node->n_visits++;
-        node->score += score;
-        node = node->parent;
-        score = 1 - score;
+    memset(obj->table, 0, (obj->table_mask + 1) * sizeof(struct dag_slot));
+    obj->arena_used = 1;
+    obj->edges_used = 1;
+}
+
+/* Find the node of the position with the given key, creating it with player
+ * to move when it is new. Returns 0 when the arena is full.
+ */
+static uint32_t dag_node(struct mcts_info *obj, u64 key, char player)
+{
+    struct dag_slot *slot;
+    uint32_t i = key & obj->table_mask;
+
+    for (; (slot = &obj->table[i])->node; i = (i + 1) & obj->table_mask) {
+        if (slot->key == key)
+            return slot->node;
     }
+
+    struct node *node = arena_alloc(obj, 1, false);
+    if (!node)
+        return 0;
+    init_node(node, -1, player);
+    slot->key = key;
+    slot->node = node - obj->arena;
+    return slot->node;
 }
 
-static int expand(struct node *node, const char *table)
+static int dag_expand(struct mcts_info *obj,
+                      struct node *node,
+                      const board_t *board,
+                      u64 key)
 {
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
+    int moves[N_GRIDS];
+    int n_moves = node_moves(obj, node, board, moves);
+    int p = PLAYER_ID(node->player);
+
+    if (!n_moves || obj->edges_size - obj->edges_used < n_moves ||
+        obj->arena_size - obj->arena_used < n_moves)
+        return 0;
+
+    uint32_t *edges = &obj->edges[obj->edges_used];
     for (int i = 0; i < n_moves; i++) {
-        node->children[i] = new_node(moves[i], node->player ^ 'O' ^ 'X', node);
+        uint32_t child =
+            dag_node(obj, key ^ zobrist_table[moves[i]][p] ^ zobrist_side,
+                     node->player ^ 'O' ^ 'X');
+        edges[i] = EDGE(child, moves[i]);
     }
-    kfree(moves);
+    node->first_child = obj->edges_used;
+    node->n_children = n_moves;
+    obj->edges_used += n_moves;
     return n_moves;
 }
 
-int mcts(const char *table, char player)
-{
-    char win;
-    struct node *root = new_node(-1, player, NULL);
-    mcts_obj.nr_active_nodes = 1;
-    for (int i = 0; i < ITERATIONS; i++) {
-        struct node *node = root;
-        char temp_table[N_GRIDS];
-        memcpy(temp_table, table, N_GRIDS);
-        while (1) {
-            if ((win = check_win(temp_table)) != ' ') {
-                fixed_point_t score =
-                    calculate_win_value(win, node->player ^ 'O' ^ 'X');
-                backpropagate(node, score);
-                break;
-            }
-            if (node->n_visits == 0) {
-                fixed_point_t score = simulate(temp_table, node->player);
-                backpropagate(node, score);
-                break;
-            }
-            if (node->children[0] == NULL)
-                mcts_obj.nr_active_nodes += expand(node, temp_table);
-            node = select_move(node);
-            if (!node)
-                return -1;
-            temp_table[node->move] = node->player ^ 'O' ^ 'X';
+static uint32_t dag_select(const struct mcts_info *obj,
+                           const struct node *node)
+{
+    const uint32_t *edge = &obj->edges[node->first_child];
+    uint32_t best_edge = *edge;
+    fixed_point_t best_score = 0U;
+    uint32_t explore = parent_explore(node->n_visits);
+    for (int i = 0; i < node->n_children; i++, edge++) {
+        const struct node *child = &obj->arena[EDGE_NODE(*edge)];
+        if (child->proof == PROOF_LOSS)
+            continue;
+        fixed_point_t score =
+            uct_score(explore, child->n_visits, child->score);
+        if (score > best_score) {
+            best_score = score;
+            best_edge = *edge;
         }
     }
-    struct node *best_node = root;
-    int most_visits = -1;
-    for (int i = 0; i < N_GRIDS; i++) {
-        if (root->children[i] && root->children[i]->n_visits > most_visits) {
-            most_visits = root->children[i]->n_visits;
-            best_node = root->children[i];
+    return best_edge;
+}
+
+/* iterate() over the DAG. Statistics are updated along the path taken, so a
+ * shared node also learns from the visits made through its other parents.
+ * A proof holds for the position whatever the path to it, so a proven node
+ * reached through a new parent tries to prove that parent in turn.
+ */
+static int iterate_dag(struct mcts_info *obj, struct state_array *xoro)
+{
+    struct node *path[N_GRIDS + 1];
+    int depth = 0;
+    struct node *node = path[0] = &obj->arena[obj->root];
+    board_t temp_board = obj->root_board;
+    u64 key = obj->root_key;
+    char win = obj->root_win;
+    fixed_point_t score;
+
+    while (1) {
+        if (node->proof != PROOF_NONE) {
+            if (depth)
+                solve(obj, path, depth);
+            backpropagate(path, depth, proof_score(node->proof), false);
+            return 1;
+        }
+        if (win != ' ') {
+            if (depth)
+                prove_terminal(obj, path, depth, win);
+            score = calculate_win_value(win, node->player ^ 'O' ^ 'X');
+            backpropagate(path, depth, score, false);
+            return 1;
         }
+        if (node->n_visits == 0 ||
+            (!node->first_child && !dag_expand(obj, node, &temp_board, key))) {
+            score = rollout(xoro, &temp_board, node->player);
+            backpropagate(path, depth, score, false);
+            return 1;
+        }
+
+        uint32_t edge = dag_select(obj, node);
+        int move = EDGE_MOVE(edge);
+        board_play(&temp_board, move, node->player);
+        key ^= zobrist_table[move][PLAYER_ID(node->player)] ^ zobrist_side;
+        node = path[++depth] = &obj->arena[EDGE_NODE(edge)];
+        win = check_win_after(&temp_board, move);
+    }
+}
+
+/* The DAG is kept across searches as it is: a position seen before comes
+ * with its statistics. It starts afresh once half of the arena is used,
+ * leaving room for a full search of ITERATIONS with the default size.
+ */
+static void dag_find_root(struct mcts_info *obj,
+                          const board_t *board,
+                          char player)
+{
+    if (!obj->tree_valid || obj->arena_used > obj->arena_size / 2 ||
+        obj->edges_used > obj->edges_size / 2)
+        dag_reset(obj);
+    obj->root_key = zobrist_key(board) ^ (player == 'X' ? zobrist_side : 0);
+    obj->root = dag_node(obj, obj->root_key, player);
+}
+
+static inline s64 now_ns(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+/* Copy the subtree rooted at src into the spare arena breadth-first, using
+ * the copied nodes themselves as the scan queue, then swap the arenas.
+ * Everything outside the subtree is dropped with the old arena.
+ */
+static struct node *arena_keep(struct mcts_info *obj, const struct node *src)
+{
+    struct node *from = obj->arena, *to = obj->spare;
+    int used = 1;
+
+    to[0] = *src;
+    for (int scan = 0; scan < used; scan++) {
+        struct node *node = &to[scan];
+        if (!node->first_child)
+            continue;
+        memcpy(&to[used], &from[node->first_child],
+               node->n_children * sizeof(struct node));
+        if (obj->amaf)
+            memcpy(&obj->amaf_spare[used], &obj->amaf[node->first_child],
+                   node->n_children * sizeof(struct amaf));
+        node->first_child = used;
+        used += node->n_children;
+    }
+
+    obj->arena = to;
+    obj->spare = from;
+    obj->arena_used = used;
+    if (obj->amaf) {
+        struct amaf *amaf = obj->amaf;
+        obj->amaf = obj->amaf_spare;
+        obj->amaf_spare = amaf;
+    }
+    return &to[0];
+}
+
+static const struct node *find_child(const struct mcts_info *obj,
+                                     const struct node *node,
+                                     int move)
+{
+    const struct node *child = &obj->arena[node->first_child];
+    for (int i = 0; node->first_child && i < node->n_children; i++, child++) {
+        if (child->move == move)
+            return child;
+    }
+    return NULL;
+}
+
+/* Find the root for a search from board. When board follows from the root of
+ * the previous search by one move of player and one reply of the opponent,
+ * the node two plies down is kept as the new root; otherwise the tree starts
+ * afresh.
+ */
+static void find_root(struct mcts_info *obj, const board_t *board, char player)
+{
+    const board_t *last = &obj->root_board;
+    int me = PLAYER_ID(player), opp = !me;
+    uint16_t ours = board->mask[me] & ~last->mask[me];
+    uint16_t reply = board->mask[opp] & ~last->mask[opp];
+
+    if (obj->tree_valid && obj->root_player == player &&
+        (board->mask[me] & last->mask[me]) == last->mask[me] &&
+        (board->mask[opp] & last->mask[opp]) == last->mask[opp] &&
+        popcount16(ours) == 1 && popcount16(reply) == 1) {
+        const struct node *node =
+            find_child(obj, &obj->arena[0], __builtin_ctz(ours));
+        if (node)
+            node = find_child(obj, node, __builtin_ctz(reply));
+        if (node) {
+            arena_keep(obj, node);
+            return;
+        }
+    }
+
+    arena_reset(obj);
+    init_node(arena_alloc(obj, 1, false), -1, player);
+}
+
+void mcts_begin(struct mcts_info *obj,
+                const board_t *board,
+                char player,
+                int budget_us)
+{
+    if (obj->dag) {
+        dag_find_root(obj, board, player);
+    } else {
+        find_root(obj, board, player);
+        obj->root = 0;
+    }
+    obj->root_board = *board;
+    obj->root_player = player;
+    obj->root_win = check_win(board);
+    obj->deadline = budget_us > 0 ? now_ns() + budget_us * 1000LL : 0;
+}
+
+static inline bool out_of_time(const struct mcts_info *obj, int i)
+{
+    return obj->deadline && !(i & (MCTS_CLOCK_INTERVAL - 1)) && i &&
+           now_ns() >= obj->deadline;
+}
+
+/* Nothing is left to search once the root is proven */
+static inline bool root_proven(const struct mcts_info *obj)
+{
+    return load_stat(obj->arena[obj->root].proof) != PROOF_NONE;
+}
+
+int mcts_worker(struct mcts_info *obj,
+                struct state_array *xoro,
+                int iterations)
+{
+    int n = 0;
+    for (int i = 0; obj->deadline || n < iterations; i++) {
+        if (out_of_time(obj, i) || root_proven(obj))
+            break;
+        n += iterate(obj, xoro, true);
+    }
+    return n;
+}
+
+int mcts_run(struct mcts_info *obj, int iterations)
+{
+    int n = 0;
+    for (int i = 0; obj->deadline || n < iterations; i++) {
+        if (out_of_time(obj, i) || root_proven(obj))
+            break;
+        if (obj->dag)
+            n += iterate_dag(obj, &obj->xoro_obj);
+        else if (obj->amaf)
+            n += iterate_rave(obj, &obj->xoro_obj);
+        else
+            n += iterate(obj, &obj->xoro_obj, false);
+    }
+    return n;
+}
+
+/* The count reported for a root move: a move proven to win outweighs every
+ * other, and a move proven to lose is dropped unless they all lose. total
+ * is at least the count of any root move: in DAG mode a child also counts
+ * the visits made through its other parents, so the root's own count is
+ * not enough.
+ */
+static int root_visits(const struct node *root,
+                       const struct node *child,
+                       int total)
+{
+    if (child->proof == PROOF_WIN)
+        return total;
+    if (child->proof == PROOF_LOSS && root->proof != PROOF_WIN)
+        return 0;
+    return child->n_visits;
+}
+
+void mcts_end(struct mcts_info *obj, int *visits)
+{
+    const struct node *root = &obj->arena[obj->root];
+    const struct node *child = &obj->arena[root->first_child];
+
+    memset(visits, 0, N_GRIDS * sizeof(int));
+    if (obj->dag) {
+        int total = 0;
+        for (int i = 0; i < root->n_children; i++)
+            total += child_node(obj, root, i)->n_visits;
+        for (int i = 0; i < root->n_children; i++) {
+            uint32_t edge = obj->edges[root->first_child + i];
+            visits[EDGE_MOVE(edge)] =
+                root_visits(root, &obj->arena[EDGE_NODE(edge)], total);
+        }
+    }
+    for (int i = 0; !obj->dag && root->first_child && i < root->n_children;
+         i++, child++)
+        visits[child->move] = root_visits(root, child, root->n_visits);
+
+    /* Keep the tree for the next search, see find_root() */
+    arena_track(obj);
+    obj->nr_active_nodes = obj->arena_used;
+    obj->tree_valid = 1;
+}
+
+int mcts_search(struct mcts_info *obj,
+                const board_t *board,
+                char player,
+                int budget_us,
+                int *visits)
+{
+    int n;
+
+    mcts_begin(obj, board, player, budget_us);
+    n = mcts_run(obj, ITERATIONS);
+    mcts_end(obj, visits);
+    return n;
+}
+
+int mcts_best_move(const int *visits)
+{
+    int best_move = -1;
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (visits[i] && (best_move < 0 || visits[i] > visits[best_move]))
+            best_move = i;
     }
-    int best_move = best_node->move;
-    free_node(root);
     return best_move;
 }
 
-void mcts_init(void)
+int mcts_info_init(struct mcts_info *obj, int arena_size, int stream)
 {
-    xoro_init(&(mcts_obj.xoro_obj));
-    mcts_obj.nr_active_nodes = 0;
+    if (!uct_recip[1])
+        uct_init();
+    xoro_init_stream(&obj->xoro_obj, stream);
+    obj->nr_active_nodes = 0;
+    obj->dag = 0;
+    obj->edges = NULL;
+    obj->table = NULL;
+    obj->amaf = obj->amaf_spare = NULL;
+
+    if (arena_size <= 0)
+        arena_size = MCTS_ARENA_SIZE;
+    obj->arena = vmalloc(array_size(arena_size, sizeof(struct node)));
+    obj->spare = vmalloc(array_size(arena_size, sizeof(struct node)));
+    if (!obj->arena || !obj->spare) {
+        pr_info("kxo: Failed to allocate space for the mcts arena\n");
+        mcts_info_exit(obj);
+        return -ENOMEM;
+    }
+    obj->arena_size = arena_size;
+    obj->arena_high_water = 0;
+    arena_reset(obj);
+    return 0;
+}
+
+void mcts_info_exit(struct mcts_info *obj)
+{
+    vfree(obj->arena);
+    vfree(obj->spare);
+    vfree(obj->edges);
+    vfree(obj->table);
+    vfree(obj->amaf);
+    vfree(obj->amaf_spare);
+    obj->arena = obj->spare = NULL;
+    obj->edges = NULL;
+    obj->table = NULL;
+    obj->amaf = obj->amaf_spare = NULL;
+}
+
+int mcts_info_enable_rave(struct mcts_info *obj)
+{
+    obj->amaf = vmalloc(array_size(obj->arena_size, sizeof(struct amaf)));
+    obj->amaf_spare =
+        vmalloc(array_size(obj->arena_size, sizeof(struct amaf)));
+    if (!obj->amaf || !obj->amaf_spare) {
+        pr_info("kxo: Failed to allocate space for the mcts RAVE stats\n");
+        vfree(obj->amaf);
+        vfree(obj->amaf_spare);
+        obj->amaf = obj->amaf_spare = NULL;
+        return -ENOMEM;
+    }
+    arena_reset(obj);
+    return 0;
+}
+
+int mcts_info_enable_dag(struct mcts_info *obj)
+{
+    uint32_t table_size = 1;
+
+    /* At most half full when the arena is */
+    while (table_size < 2U * obj->arena_size)
+        table_size <<= 1;
+    obj->edges = vmalloc(array_size(obj->arena_size, sizeof(uint32_t)));
+    obj->table = vmalloc(array_size(table_size, sizeof(struct dag_slot)));
+    if (!obj->edges || !obj->table) {
+        pr_info("kxo: Failed to allocate space for the mcts DAG\n");
+        vfree(obj->edges);
+        vfree(obj->table);
+        obj->edges = NULL;
+        obj->table = NULL;
+        return -ENOMEM;
+    }
+    obj->edges_size = obj->arena_size;
+    obj->table_mask = table_size - 1;
+    obj->dag = 1;
+    obj->tree_valid = 0;
+    return 0;
 }
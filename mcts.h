@@ -1,13 +1,102 @@
 #pragma once
 
+#include "game.h"
 #include "xoroshiro.h"
 
 #define ITERATIONS 100000
 
+/* In deadline mode the clock is read once every MCTS_CLOCK_INTERVAL
+ * iterations (must be a power of 2)
+ */
+#define MCTS_CLOCK_INTERVAL 256
+
+/* Default number of nodes preallocated for one search */
+#define MCTS_ARENA_SIZE (2 * ITERATIONS)
+
+struct node;
+struct dag_slot;
+struct amaf;
+
 struct mcts_info {
     struct state_array xoro_obj;
     int nr_active_nodes;
+    struct node *arena, *spare;
+    int arena_size, arena_used, arena_high_water;
+
+    /* DAG mode, see mcts_info_enable_dag() */
+    int dag;
+    uint32_t *edges;
+    int edges_size, edges_used;
+    struct dag_slot *table;
+    uint32_t table_mask;
+
+    /* RAVE mode, see mcts_info_enable_rave() */
+    struct amaf *amaf, *amaf_spare;
+
+    /* Position of the current search; the tree is kept for the next one,
+     * see find_root()
+     */
+    int tree_valid;
+    char root_player, root_win;
+    board_t root_board;
+    uint32_t root;
+    u64 root_key;
+    int64_t deadline;
 };
 
-int mcts(const char *table, char player);
-void mcts_init(void);
+/* Independent searches, e.g. one per CPU for root parallelism: each
+ * mcts_info owns its tree, arenas and xoroshiro stream. mcts_search() looks
+ * for the best move of player. With budget_us > 0 it runs until that many
+ * microseconds have passed instead of for ITERATIONS playouts. Either way it
+ * stops as soon as the outcome of the root is proven. It stores the visit
+ * count of every root move in visits[N_GRIDS], where a move proven to win
+ * outweighs every other, and returns the number of playouts done; merged
+ * counts are turned into a move by mcts_best_move().
+ */
+int mcts_info_init(struct mcts_info *obj, int arena_size, int stream);
+void mcts_info_exit(struct mcts_info *obj);
+int mcts_search(struct mcts_info *obj,
+                const board_t *board,
+                char player,
+                int budget_us,
+                int *visits);
+int mcts_best_move(const int *visits);
+
+/* Switch obj to DAG mode, where transposed positions share one node found by
+ * Zobrist hash, so statistics are learned once per position rather than
+ * once per move order. The tree kept between searches becomes the whole DAG,
+ * which is dropped once half of the arena is used, proofs included.
+ * zobrist_init() must have been called. Not supported with mcts_worker().
+ */
+int mcts_info_enable_dag(struct mcts_info *obj);
+
+/* Switch obj to RAVE mode: every node also gathers all-moves-as-first
+ * statistics from the playouts through its parent that play its move later
+ * on, and selection blends them into the mean score with a weight that
+ * decays as the node gets visits of its own. Not supported with
+ * mcts_worker() or DAG mode.
+ */
+int mcts_info_enable_rave(struct mcts_info *obj);
+
+/* Tree parallelism: mcts_begin() prepares the root of obj, then any number
+ * of threads call mcts_worker() concurrently, each with its own xoroshiro
+ * stream, to grow the same tree. Each returns the number of playouts it did,
+ * running for the budget_us given to mcts_begin() or for iterations
+ * playouts when there is no budget. mcts_end() collects the root visit
+ * counts once all workers have returned.
+ */
+void mcts_begin(struct mcts_info *obj,
+                const board_t *board,
+                char player,
+                int budget_us);
+int mcts_worker(struct mcts_info *obj,
+                struct state_array *xoro,
+                int iterations);
+void mcts_end(struct mcts_info *obj, int *visits);
+
+/* mcts_search() in steps: after mcts_begin(), every mcts_run() call does
+ * another iterations playouts (or runs until the budget given to
+ * mcts_begin() is used up), and mcts_end() may be called in between to read
+ * the root visit counts so far.
+ */
+int mcts_run(struct mcts_info *obj, int iterations);
@@ -0,0 +1,88 @@
+#include "rollout.h"
+
+/* Each xoroshiro output feeds two moves, 32 random bits each */
+struct rollout_rng {
+    struct state_array *xoro;
+    u64 bits;
+    int left;
+};
+
+static inline uint32_t next32(struct rollout_rng *rng)
+{
+    if (!rng->left) {
+        rng->bits = xoro_next(rng->xoro);
+        rng->left = 2;
+    }
+    rng->left--;
+    uint32_t r = rng->bits;
+    rng->bits >>= 32;
+    return r;
+}
+
+/* Uniform integer in [0, n) by Lemire's multiply-shift, rejecting the few
+ * low products that would bias it. See https://arxiv.org/abs/1805.10941
+ */
+static inline uint32_t random_below(struct rollout_rng *rng, uint32_t n)
+{
+    uint64_t m = (uint64_t) next32(rng) * n;
+
+    if ((uint32_t) m < n) {
+        uint32_t threshold = -n % n;
+        while ((uint32_t) m < threshold)
+            m = (uint64_t) next32(rng) * n;
+    }
+    return m >> 32;
+}
+
+/* The empty grids are kept in a bitmask and the k-th one is picked by
+ * clearing the k lowest set bits. Only the stones of the player who just
+ * moved can complete a segment, and only one through that move, so each
+ * ply tests the segments of a single grid against a single mask.
+ */
+static inline fixed_point_t playout(struct state_array *xoro,
+                                   const board_t *board,
+                                   char player,
+                                   board_t *final)
+{
+    struct rollout_rng rng = {.xoro = xoro};
+    uint16_t mask[2] = {board->mask[0], board->mask[1]};
+    uint16_t empty = board_empty(board);
+    int me = PLAYER_ID(player), p = me;
+    fixed_point_t result = 1U << (FIXED_SCALE_BITS - 1);
+
+    while (empty) {
+        uint16_t bits = empty;
+        for (uint32_t k = random_below(&rng, popcount16(empty)); k; k--)
+            bits &= bits - 1;
+
+        int move = __builtin_ctz(bits);
+        mask[p] |= 1U << move;
+        empty &= ~(1U << move);
+        if (wins_through(mask[p], move)) {
+            result = p == me ? 0U : 1U << FIXED_SCALE_BITS;
+            break;
+        }
+        p ^= 1;
+    }
+
+    if (final) {
+        final->mask[0] = mask[0];
+        final->mask[1] = mask[1];
+    }
+    return result;
+}
+
+fixed_point_t rollout(struct state_array *xoro,
+                      const board_t *board,
+                      char player)
+{
+    return playout(xoro, board, player, NULL);
+}
+
+fixed_point_t rollout_final(struct state_array *xoro,
+                            const board_t *board,
+                            char player,
+                            board_t *final)
+{
+    return playout(xoro, board, player, final);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "game.h"
+#include "xoroshiro.h"
+
+/* Play uniformly random moves from board, player to move first, until the
+ * game ends, and score the result for the opponent of player, who made the
+ * move leading to board.
+ */
+fixed_point_t rollout(struct state_array *xoro,
+                      const board_t *board,
+                      char player);
+
+/* rollout(), also storing the position the playout ended in into *final */
+fixed_point_t rollout_final(struct state_array *xoro,
+                            const board_t *board,
+                            char player,
+                            board_t *final);
+
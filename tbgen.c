@@ -0,0 +1,254 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./user_space_ai/tablebase.h"
+#include "game.h"
+
+/* Solve every position reachable from the empty board by retrograde
+ * analysis and write the tablebase read by tablebase_probe(). Run
+ * "./tbgen [file [threads]]".
+ *
+ * Positions are kept in layers by the number of stones on the board, one
+ * per class of symmetric positions. Moves only add stones, so once layer
+ * k + 1 is solved every position of layer k can be solved independently
+ * from its children, and the layers are solved from the full board down to
+ * the empty one, each split between the threads.
+ */
+
+#define TBGEN_CHUNK 1024
+
+typedef struct {
+    uint32_t *key; /* canonical mask[0] | mask[1] << 16, sorted */
+    uint8_t *value;
+    uint8_t *dist; /* plies to the end of the game under perfect play */
+    uint8_t *move;
+    size_t n;
+} layer_t;
+
+/* Layer k holds the positions with k stones that do not end the game */
+static layer_t layers[N_GRIDS];
+static int cur_layer;
+static size_t next_pos;
+
+static inline board_t key_board(uint32_t key)
+{
+    board_t board = {{key & 0xffff, key >> 16}};
+    return board;
+}
+
+static inline uint32_t board_key(const board_t *board)
+{
+    return board->mask[0] | (uint32_t) board->mask[1] << 16;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "[tbgen] memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Fill layer k with the positions one move away from layer k - 1 */
+static void expand_layer(int k)
+{
+    const layer_t *prev = &layers[k - 1];
+    layer_t *layer = &layers[k];
+    char player = (k - 1) & 1 ? 'X' : 'O';
+    size_t n = 0;
+
+    layer->key = xmalloc(prev->n * (N_GRIDS - k + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < prev->n; i++) {
+        board_t board = key_board(prev->key[i]), canon;
+        for_each_empty_grid(move, &board) {
+            board_play(&board, move, player);
+            if (check_win_after(&board, move) == ' ') {
+                board_canonical(&board, &canon);
+                layer->key[n++] = board_key(&canon);
+            }
+            board_undo(&board, move, player);
+        }
+    }
+
+    qsort(layer->key, n, sizeof(uint32_t), cmp_key);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!m || layer->key[i] != layer->key[m - 1])
+            layer->key[m++] = layer->key[i];
+    }
+    layer->n = m;
+}
+
+/* Rank of a value reached dist plies from now: win quickly, lose slowly */
+static inline int rank(int value, int dist)
+{
+    if (value == TABLEBASE_WIN)
+        return 2 * N_GRIDS - dist;
+    if (value == TABLEBASE_LOSS)
+        return dist - 2 * N_GRIDS;
+    return 0;
+}
+
+static void solve_position(int k, size_t i)
+{
+    layer_t *layer = &layers[k];
+    const layer_t *next = &layers[k + 1];
+    board_t board = key_board(layer->key[i]), canon;
+    char player = k & 1 ? 'X' : 'O';
+    int best_rank = -4 * N_GRIDS;
+
+    for_each_empty_grid(move, &board) {
+        int value, dist;
+
+        board_play(&board, move, player);
+        char win = check_win_after(&board, move);
+        if (win != ' ') {
+            value = win == 'D' ? TABLEBASE_DRAW : TABLEBASE_WIN;
+            dist = 1;
+        } else {
+            board_canonical(&board, &canon);
+            uint32_t key = board_key(&canon);
+            const uint32_t *child =
+                bsearch(&key, next->key, next->n, sizeof(uint32_t), cmp_key);
+            size_t j = child - next->key;
+            value = 4 - next->value[j];
+            dist = next->dist[j] + 1;
+        }
+        board_undo(&board, move, player);
+
+        if (rank(value, dist) > best_rank) {
+            best_rank = rank(value, dist);
+            layer->value[i] = value;
+            layer->dist[i] = dist;
+            layer->move[i] = move;
+        }
+    }
+}
+
+static void *solve_worker(void *arg)
+{
+    const layer_t *layer = &layers[cur_layer];
+    size_t i;
+
+    (void) arg;
+    while ((i = __atomic_fetch_add(&next_pos, TBGEN_CHUNK,
+                                   __ATOMIC_RELAXED)) < layer->n) {
+        size_t end = i + TBGEN_CHUNK < layer->n ? i + TBGEN_CHUNK : layer->n;
+        for (; i < end; i++)
+            solve_position(cur_layer, i);
+    }
+    return NULL;
+}
+
+static void solve_layer(int k, int n_threads)
+{
+    layer_t *layer = &layers[k];
+    pthread_t threads[n_threads];
+
+    layer->value = xmalloc(layer->n);
+    layer->dist = xmalloc(layer->n);
+    layer->move = xmalloc(layer->n);
+    cur_layer = k;
+    next_pos = 0;
+    for (int t = 0; t < n_threads; t++)
+        pthread_create(&threads[t], NULL, solve_worker, NULL);
+    for (int t = 0; t < n_threads; t++)
+        pthread_join(threads[t], NULL);
+}
+
+static int write_tablebase(const char *path, size_t n_positions)
+{
+    struct tablebase_header hdr = {
+        .magic = TABLEBASE_MAGIC,
+        .board_size = BOARD_SIZE,
+        .goal = GOAL,
+        .n_positions = n_positions,
+    };
+
+    /* Keep the table at most 3/4 full so that probes stay short */
+    hdr.slot_bits = 1;
+    while ((3UL << hdr.slot_bits) < 4 * n_positions)
+        hdr.slot_bits++;
+
+    size_t n_slots = 1UL << hdr.slot_bits;
+    uint32_t *slots = calloc(n_slots, sizeof(uint32_t));
+    if (!slots) {
+        fprintf(stderr, "[tbgen] memory allocation failed\n");
+        return -1;
+    }
+    for (int k = 0; k < N_GRIDS; k++) {
+        const layer_t *layer = &layers[k];
+        for (size_t i = 0; i < layer->n; i++) {
+            board_t board = key_board(layer->key[i]);
+            uint32_t index = tablebase_index(&board);
+            uint32_t h = tablebase_hash(index, hdr.slot_bits);
+            while (slots[h])
+                h = (h + 1) & (n_slots - 1);
+            slots[h] =
+                TABLEBASE_SLOT(index, layer->value[i], layer->move[i]);
+        }
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror(path);
+        free(slots);
+        return -1;
+    }
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(slots, sizeof(uint32_t), n_slots, fp) == n_slots;
+    if (fclose(fp) || !ok) {
+        perror(path);
+        free(slots);
+        return -1;
+    }
+    printf("%s: %zu positions in %zu slots, %zu bytes\n", path, n_positions,
+           n_slots, sizeof(hdr) + n_slots * sizeof(uint32_t));
+    free(slots);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *value_name[] = {"?", "win", "draw", "loss"};
+    const char *path = argc > 1 ? argv[1] : TABLEBASE_FILE;
+    int n_threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_positions = 0;
+    struct timespec start, end;
+
+    if (n_threads < 1)
+        n_threads = 1;
+    game_init();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    layers[0].key = xmalloc(sizeof(uint32_t));
+    layers[0].key[0] = 0;
+    layers[0].n = 1;
+    for (int k = 1; k < N_GRIDS; k++)
+        expand_layer(k);
+    for (int k = N_GRIDS - 1; k >= 0; k--) {
+        solve_layer(k, n_threads);
+        n_positions += layers[k].n;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("solved %zu positions in %.3f s with %d threads, "
+           "empty board: %s in %d plies\n",
+           n_positions,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+           n_threads, value_name[layers[0].value[0]], layers[0].dist[0]);
+
+    return write_tablebase(path, n_positions) < 0;
+}
@@ -1,8 +1,11 @@
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 typedef uint64_t u64;
 typedef __uint128_t u128;
 
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
 #include <linux/string.h>
 
 #include "../game.h"
@@ -10,93 +13,286 @@ typedef __uint128_t u128;
 #include "negamax.h"
 #include "zobrist.h"
 
-#define MAX_SEARCH_DEPTH 6
+/* Move ordering: the best move stored for the position comes first, then
+ * the killer moves of the ply, which caused a cutoff in a sibling position,
+ * then the others by history, i.e. by the summed squared depths of the
+ * cutoffs they caused anywhere in the search. Ties in history go to the
+ * grids on more winning segments, which fit in the low ORDER_HISTORY_SHIFT
+ * bits of the key. The keys of the first two groups lie above any history
+ * value.
+ */
+#define ORDER_TT_MOVE (INT_MAX)
+#define ORDER_KILLER (INT_MAX - 2)
+#define ORDER_HISTORY_SHIFT 4
+
+#if MAX_GRID_SEGMENTS >= (1 << ORDER_HISTORY_SHIFT)
+#error "ORDER_HISTORY_SHIFT is too small for the segments through a grid"
+#endif
+
+/* A move and the key it is ordered by, highest first */
+struct move_order {
+    int key;
+    int move;
+};
+
+/* Fill order with the empty grids of the board, best first, and return
+ * their number. With at most N_GRIDS moves an insertion sort is cheapest.
+ */
+static int order_moves(const struct negamax_context *ctx,
+                       struct move_order *order,
+                       int tt_move)
+{
+    const int8_t *killers = ctx->killers[ctx->ply];
+    int n_moves = 0;
+
+    for_each_empty_grid(m, &ctx->board) {
+        int key = (ctx->history[m] << ORDER_HISTORY_SHIFT) +
+                  grid_segments[m].n;
+        int i;
+
+        if (m == tt_move)
+            key = ORDER_TT_MOVE;
+        else if (m == killers[0])
+            key = ORDER_KILLER;
+        else if (m == killers[1])
+            key = ORDER_KILLER - 1;
 
-static int history_score_sum[N_GRIDS];
-static int history_count[N_GRIDS];
+        for (i = n_moves++; i > 0 && order[i - 1].key < key; i--)
+            order[i] = order[i - 1];
+        order[i].key = key;
+        order[i].move = m;
+    }
+    return n_moves;
+}
+
+/* Credit move with a cutoff at depth in the current ply */
+static void record_cutoff(struct negamax_context *ctx, int move, int depth)
+{
+    int8_t *killers = ctx->killers[ctx->ply];
+
+    if (killers[0] != move) {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+    ctx->history[move] += depth * depth;
+}
+
+/* Make and unmake a move of the side to move, keeping the hashes and the
+ * segments through the move in step. Every move also hands the turn over,
+ * which flips zobrist_side in the hashes.
+ */
+static inline void update_hash(struct negamax_context *ctx, int move)
+{
+    int p = PLAYER_ID(ctx->player);
+    for (int t = 0; t < N_SYMMETRIES; t++)
+        ctx->hash[t] ^= zobrist_table[sym_grid[t][move]][p] ^ zobrist_side;
+}
+
+static inline void add_stone(struct negamax_context *ctx, int move, int delta)
+{
+    const grid_segments_t *gs = &grid_segments[move];
+    int step = ctx->player == 'O' ? LINE_INDEX(delta, 0) : LINE_INDEX(0, delta);
+
+    for (int i = 0; i < gs->n; i++) {
+        uint8_t *pattern = &ctx->segment[gs->id[i]];
+        ctx->eval -= line_score[*pattern];
+        ctx->n_won -= line_winner[*pattern] != ' ';
+        *pattern += step;
+        ctx->eval += line_score[*pattern];
+        ctx->n_won += line_winner[*pattern] != ' ';
+    }
+}
+
+static inline void negamax_play(struct negamax_context *ctx, int move)
+{
+    board_play(&ctx->board, move, ctx->player);
+    update_hash(ctx, move);
+    add_stone(ctx, move, 1);
+    ctx->player ^= 'O' ^ 'X';
+    ctx->ply++;
+}
+
+static inline void negamax_undo(struct negamax_context *ctx, int move)
+{
+    ctx->ply--;
+    ctx->player ^= 'O' ^ 'X';
+    board_undo(&ctx->board, move, ctx->player);
+    update_hash(ctx, move);
+    add_stone(ctx, move, -1);
+}
 
-static u64 hash_value;
+/* Positions are stored under the smallest key of their images, which all
+ * the positions symmetric to each other share, with the best move given on
+ * that image. Returns the symmetry to that image.
+ */
+static inline int canonical_key(const struct negamax_context *ctx, u64 *key)
+{
+    int canon = 0;
+    for (int t = 1; t < N_SYMMETRIES; t++) {
+        if (ctx->hash[t] < ctx->hash[canon])
+            canon = t;
+    }
+    *key = ctx->hash[canon];
+    return canon;
+}
 
-static int cmp_moves(const void *a, const void *b)
+static inline int map_move(int t, int move)
 {
-    const int *_a = (int *) a, *_b = (int *) b;
-    int score_a = 0, score_b = 0;
+    return move < 0 ? move : sym_grid[t][move];
+}
 
-    if (history_count[*_a])
-        score_a = history_score_sum[*_a] / history_count[*_a];
-    if (history_count[*_b])
-        score_b = history_score_sum[*_b] / history_count[*_b];
-    return score_b - score_a;
+/* Whether the Lazy SMP search ctx helps was asked to stop */
+static inline int stopped(const struct negamax_context *ctx)
+{
+    return ctx->stop && READ_ONCE(*ctx->stop);
 }
 
-static move_t negamax(char *table, int depth, char player, int alpha, int beta)
+static move_t negamax(struct negamax_context *ctx,
+                      int depth,
+                      int alpha,
+                      int beta)
 {
-    if (check_win(table) != ' ' || depth == 0) {
-        move_t result = {get_score(table, player), -1};
+    ctx->nodes++;
+    if (ctx->n_won || !board_empty(&ctx->board) || depth == 0) {
+        move_t result = {ctx->player == 'O' ? ctx->eval : -ctx->eval, -1};
         return result;
     }
-    const zobrist_entry_t *entry = zobrist_get(hash_value);
-    if (entry)
-        return (move_t){.score = entry->score, .move = entry->move};
 
-    int score;
-    move_t best_move = {-10000, -1};
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
+    /* A stored result settles the position if it was searched at least as
+     * deep and its bound is tight enough for the window
+     */
+    u64 key;
+    int canon = canonical_key(ctx, &key);
+    zobrist_data_t entry;
+    int found = zobrist_get(key, &entry);
+    int tt_move = found ? map_move(sym_inverse[canon], entry.move) : -1;
+    if (found && entry.depth >= depth &&
+        (entry.bound == ZOBRIST_EXACT ||
+         (entry.bound == ZOBRIST_LOWER && entry.score >= beta) ||
+         (entry.bound == ZOBRIST_UPPER && entry.score <= alpha)))
+        return (move_t){.score = entry.score, .move = tt_move};
 
-    qsort(moves, n_moves, sizeof(int), cmp_moves);
+    int score, alpha_orig = alpha;
+    move_t best_move = {-10000, -1};
+    struct move_order order[N_GRIDS];
+    int n_moves = order_moves(ctx, order, tt_move);
 
     for (int i = 0; i < n_moves; i++) {
-        table[moves[i]] = player;
-        hash_value ^= zobrist_table[moves[i]][player == 'X'];
+        int move = order[i].move;
+
+        negamax_play(ctx, move);
         if (!i)
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X', -beta,
-                             -alpha)
-                         .score;
+            score = -negamax(ctx, depth - 1, -beta, -alpha).score;
         else {
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
-                             -alpha - 1, -alpha)
-                         .score;
+            score = -negamax(ctx, depth - 1, -alpha - 1, -alpha).score;
             if (alpha < score && score < beta)
-                score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
-                                 -beta, -score)
-                             .score;
+                score = -negamax(ctx, depth - 1, -beta, -score).score;
         }
-        history_count[moves[i]]++;
-        history_score_sum[moves[i]] += score;
+        negamax_undo(ctx, move);
+        /* The scores of an interrupted search are not to be stored */
+        if (stopped(ctx))
+            return best_move;
         if (score > best_move.score) {
             best_move.score = score;
-            best_move.move = moves[i];
+            best_move.move = move;
         }
-        table[moves[i]] = ' ';
-        hash_value ^= zobrist_table[moves[i]][player == 'X'];
         if (score > alpha)
             alpha = score;
-        if (alpha >= beta)
+        if (alpha >= beta) {
+            record_cutoff(ctx, move, depth);
             break;
+        }
     }
 
-    free((char *) moves);
-    zobrist_put(hash_value, best_move.score, best_move.move);
+    int bound = ZOBRIST_EXACT;
+    if (best_move.score <= alpha_orig)
+        bound = ZOBRIST_UPPER;
+    else if (best_move.score >= beta)
+        bound = ZOBRIST_LOWER;
+    zobrist_put(key, depth, bound, best_move.score,
+                map_move(canon, best_move.move));
     return best_move;
 }
 
-void negamax_init(void)
+int negamax_init(unsigned int tt_kb, uint64_t seed)
 {
-    zobrist_init();
-    hash_value = 0;
+    zobrist_init(seed);
+    return zobrist_tt_init(tt_kb);
 }
 
-move_t negamax_predict(char *table, char player)
+void negamax_exit(void)
 {
-    memset(history_score_sum, 0, sizeof(history_score_sum));
-    memset(history_count, 0, sizeof(history_count));
-    move_t result;
-    for (int depth = 2; depth <= MAX_SEARCH_DEPTH; depth += 2) {
-        result = negamax(table, depth, player, -100000, 100000);
-        zobrist_clear();
+    zobrist_tt_exit();
+}
+
+void negamax_context_init(struct negamax_context *ctx,
+                          const board_t *board,
+                          char player)
+{
+    ctx->board = *board;
+    ctx->player = player;
+    for (int t = 0; t < N_SYMMETRIES; t++) {
+        board_t image = {{sym_mask(t, board->mask[0]),
+                          sym_mask(t, board->mask[1])}};
+        ctx->hash[t] = zobrist_key(&image) ^ (player == 'X' ? zobrist_side : 0);
+    }
+    ctx->eval = 0;
+    ctx->n_won = 0;
+    for (int i = 0; i < N_SEGMENTS; i++) {
+        int pattern = LINE_INDEX(popcount16(board->mask[0] & win_segments[i]),
+                                 popcount16(board->mask[1] & win_segments[i]));
+        ctx->segment[i] = pattern;
+        ctx->eval += line_score[pattern];
+        ctx->n_won += line_winner[pattern] != ' ';
     }
+    ctx->ply = 0;
+    ctx->nodes = 0;
+    ctx->helper = 0;
+    ctx->stop = NULL;
+    memset(ctx->killers, -1, sizeof(ctx->killers));
+    memset(ctx->history, 0, sizeof(ctx->history));
+}
+
+void negamax_context_helper(struct negamax_context *ctx,
+                            int helper,
+                            const int *stop)
+{
+    ctx->helper = helper;
+    ctx->stop = stop;
+
+    /* Seed the history with a little noise of the helper's own, which is
+     * enough to reorder moves of equal history and segment count
+     */
+    for (int i = 0; i < N_GRIDS; i++)
+        ctx->history[i] = ((i + 1) * helper * 0x9e3779b1U) >> 30;
+}
+
+move_t negamax_search_depth(struct negamax_context *ctx, int max_depth)
+{
+    move_t result = {0, -1};
+
+    /* Entries are keyed by whole positions, so the ones from the previous
+     * deepening steps and from earlier moves stay valid. Every other helper
+     * deepens through the odd depths so that the helpers do not all repeat
+     * the work of the main search.
+     */
+    int offset = ctx->helper & 1;
+    for (int depth = 2 + offset; depth <= max_depth + offset && !stopped(ctx);
+         depth += 2)
+        result = negamax(ctx, depth, -100000, 100000);
     return result;
 }
+
+move_t negamax_search(struct negamax_context *ctx)
+{
+    zobrist_clear();
+    return negamax_search_depth(ctx, MAX_SEARCH_DEPTH);
+}
+
+move_t negamax_predict(const board_t *board, char player)
+{
+    struct negamax_context ctx;
+
+    negamax_context_init(&ctx, board, player);
+    return negamax_search(&ctx);
+}
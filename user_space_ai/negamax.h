@@ -1,8 +1,71 @@
 #pragma once
 
+#include "../game.h"
+
+/* Depth of negamax_search(), in plies */
+#define MAX_SEARCH_DEPTH 6
+
 typedef struct {
     int score, move;
 } move_t;
 
-void negamax_init(void);
-move_t negamax_predict(char *table, char player);
+/* State of one search. The position, the side to move, the Zobrist keys of
+ * the N_SYMMETRIES images and the distance from the root are updated as
+ * moves are made and unmade. So are segment[], the pattern of every
+ * winning segment (see LINE_INDEX()), eval, their summed evaluation for
+ * 'O', and n_won, the number of segments a player has filled. killers[],
+ * history[] and nodes count the moves that caused cutoffs and the nodes
+ * visited.
+ *
+ * Searches on different contexts share nothing but the transposition
+ * table, so they can run in parallel. helper and stop are only set for the
+ * helpers of a Lazy SMP search, see negamax_context_helper().
+ */
+struct negamax_context {
+    board_t board;
+    char player;
+    int ply;
+    uint64_t hash[N_SYMMETRIES];
+    uint8_t segment[N_SEGMENTS];
+    int eval;
+    int n_won;
+    int8_t killers[N_GRIDS + 1][2];
+    int history[N_GRIDS];
+    unsigned long nodes;
+    int helper;
+    const int *stop;
+};
+
+/* negamax_init() allocates a transposition table of tt_kb KiB and draws
+ * the Zobrist keys from seed, see zobrist_init()
+ */
+int negamax_init(unsigned int tt_kb, uint64_t seed);
+void negamax_exit(void);
+
+/* Set up ctx for a search of board with player to move, then search it by
+ * iterative deepening with negamax_search(), or with negamax_search_depth()
+ * to go max_depth plies deep instead of the default depth. Deepening goes
+ * two plies at a time from 2, so an odd max_depth is rounded down, and a
+ * max_depth below 2 returns move -1. negamax_predict() does the former on
+ * a context of its own. negamax_search() starts a new transposition table
+ * generation, see zobrist_clear(), while the caller of
+ * negamax_search_depth() does so itself, once for all the searches of a
+ * position when they run in parallel.
+ */
+void negamax_context_init(struct negamax_context *ctx,
+                          const board_t *board,
+                          char player);
+move_t negamax_search(struct negamax_context *ctx);
+move_t negamax_search_depth(struct negamax_context *ctx, int max_depth);
+
+/* Lazy SMP: any number of helper searches of the same position may run on
+ * other CPUs next to the main search, only sharing the transposition table
+ * with it. They fill the table with results that the main search then finds
+ * ready, and only the result of the main search is used. Helper number
+ * helper, counted from 1, searches through its own move order and, when
+ * odd, depths one ply off those of the main search, until *stop is set.
+ */
+void negamax_context_helper(struct negamax_context *ctx,
+                            int helper,
+                            const int *stop);
+move_t negamax_predict(const board_t *board, char player);
@@ -0,0 +1,222 @@
+#include "rollout.h"
+
+/* Each xoroshiro output feeds two moves, 32 random bits each */
+struct rollout_rng {
+    struct state_array *xoro;
+    u64 bits;
+    int left;
+};
+
+static inline uint32_t next32(struct rollout_rng *rng)
+{
+    if (!rng->left) {
+        rng->bits = xoro_next(rng->xoro);
+        rng->left = 2;
+    }
+    rng->left--;
+    uint32_t r = rng->bits;
+    rng->bits >>= 32;
+    return r;
+}
+
+/* Uniform integer in [0, n) by Lemire's multiply-shift, rejecting the few
+ * low products that would bias it. See https://arxiv.org/abs/1805.10941
+ */
+static inline uint32_t random_below(struct rollout_rng *rng, uint32_t n)
+{
+    uint64_t m = (uint64_t) next32(rng) * n;
+
+    if ((uint32_t) m < n) {
+        uint32_t threshold = -n % n;
+        while ((uint32_t) m < threshold)
+            m = (uint64_t) next32(rng) * n;
+    }
+    return m >> 32;
+}
+
+/* The empty grids are kept in a bitmask and the k-th one is picked by
+ * clearing the k lowest set bits. Only the stones of the player who just
+ * moved can complete a segment, and only one through that move, so each
+ * ply tests the segments of a single grid against a single mask.
+ */
+static inline fixed_point_t playout(struct state_array *xoro,
+                                   const board_t *board,
+                                   char player,
+                                   board_t *final)
+{
+    struct rollout_rng rng = {.xoro = xoro};
+    uint16_t mask[2] = {board->mask[0], board->mask[1]};
+    uint16_t empty = board_empty(board);
+    int me = PLAYER_ID(player), p = me;
+    fixed_point_t result = 1U << (FIXED_SCALE_BITS - 1);
+
+    while (empty) {
+        uint16_t bits = empty;
+        for (uint32_t k = random_below(&rng, popcount16(empty)); k; k--)
+            bits &= bits - 1;
+
+        int move = __builtin_ctz(bits);
+        mask[p] |= 1U << move;
+        empty &= ~(1U << move);
+        if (wins_through(mask[p], move)) {
+            result = p == me ? 0U : 1U << FIXED_SCALE_BITS;
+            break;
+        }
+        p ^= 1;
+    }
+
+    if (final) {
+        final->mask[0] = mask[0];
+        final->mask[1] = mask[1];
+    }
+    return result;
+}
+
+fixed_point_t rollout(struct state_array *xoro,
+                      const board_t *board,
+                      char player)
+{
+    return playout(xoro, board, player, NULL);
+}
+
+fixed_point_t rollout_final(struct state_array *xoro,
+                            const board_t *board,
+                            char player,
+                            board_t *final)
+{
+    return playout(xoro, board, player, final);
+}
+
+#if defined(__GNUC__) && !defined(ROLLOUT_SCALAR)
+
+/* The playouts of a batch advance in lockstep, one lane of a GCC vector per
+ * playout. All lanes start from the same board and place one stone per ply,
+ * so the number of empty grids is the same in every lane and only the lanes
+ * whose game is still running are updated. Each lane repeats what rollout()
+ * does with its generator: the random bits, the bounded random numbers and
+ * the picked grids are the same, the only difference being that a win is
+ * found by testing every entry of win_segments[] instead of those through
+ * the last move. The rare Lemire rejections are redrawn lane by lane.
+ */
+typedef uint16_t v16u16 __attribute__((vector_size(2 * ROLLOUT_LANES)));
+typedef int16_t v16i16 __attribute__((vector_size(2 * ROLLOUT_LANES)));
+typedef uint64_t v16u64 __attribute__((vector_size(8 * ROLLOUT_LANES)));
+typedef int64_t v16i64 __attribute__((vector_size(8 * ROLLOUT_LANES)));
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+#define rotl_v(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+#define blend_v(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+#define any_v(x)                               \
+    ({                                         \
+        v4u64 __y = (v4u64) (x);               \
+        !!(__y[0] | __y[1] | __y[2] | __y[3]); \
+    })
+
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "sse4.2", "default")))
+#endif
+static void rollout_lanes(struct state_array *lanes,
+                          const board_t *board,
+                          char player,
+                          fixed_point_t *scores)
+{
+    int me = PLAYER_ID(player), p = me;
+    v16u64 s0, s1, bits = {0}, left = {0};
+    v16u16 mask[2], empty, active, result;
+
+    for (int i = 0; i < ROLLOUT_LANES; i++) {
+        s0[i] = lanes[i].array[0];
+        s1[i] = lanes[i].array[1];
+        mask[0][i] = board->mask[0];
+        mask[1][i] = board->mask[1];
+        empty[i] = board_empty(board);
+        active[i] = 0xffff;
+        result[i] = 1U << (FIXED_SCALE_BITS - 1);
+    }
+
+    for (uint32_t n = popcount16(board_empty(board)); n && any_v(active);
+         n--, p ^= 1) {
+        /* next32(): refill the lanes that used up their 64 bits */
+        v16u64 live =
+            (v16u64) __builtin_convertvector((v16i16) active, v16i64);
+        v16u64 refill = live & (v16u64) (left == 0);
+        v16u64 out = rotl_v(s0 + s1, 24) + s0;
+        v16u64 t = s1 ^ s0;
+        s0 = blend_v(refill, rotl_v(s0, 24) ^ t ^ (t << 16), s0);
+        s1 = blend_v(refill, rotl_v(t, 37), s1);
+        bits = blend_v(refill, out, bits);
+        left = blend_v(refill, (v16u64) {0} + 2, left);
+
+        /* random_below(n), one 32-bit draw per live lane */
+        v16u64 m = (bits & 0xffffffffULL) * n;
+        bits = blend_v(live, bits >> 32, bits);
+        left -= live & 1;
+        for (int i = 0; i < ROLLOUT_LANES; i++) {
+            if (!live[i] || (uint32_t) m[i] >= n)
+                continue;
+            uint32_t threshold = -n % n;
+            while ((uint32_t) m[i] < threshold) {
+                struct state_array x = {{s0[i], s1[i]}};
+                struct rollout_rng rng = {&x, bits[i], left[i]};
+                m[i] = (uint64_t) next32(&rng) * n;
+                s0[i] = x.array[0];
+                s1[i] = x.array[1];
+                bits[i] = rng.bits;
+                left[i] = rng.left;
+            }
+        }
+        v16u16 k = __builtin_convertvector(m >> 32, v16u16);
+
+        /* Clear the k lowest empty grids, then take the lowest one left */
+        v16u16 pick = empty;
+        for (uint32_t j = 0; j + 1 < n; j++)
+            pick &= ~((v16u16) (k > (uint16_t) j) & (pick & -pick));
+        pick &= -pick & active;
+
+        mask[p] |= pick;
+        empty &= ~pick;
+        v16u16 won = {0};
+        for (int i = 0; i < N_SEGMENTS; i++)
+            won |= (v16u16) ((mask[p] & win_segments[i]) == win_segments[i]);
+        won &= active;
+        result = (won & (uint16_t) (p == me ? 0 : 1U << FIXED_SCALE_BITS)) |
+                 (result & ~won);
+        active &= ~won;
+    }
+
+    for (int i = 0; i < ROLLOUT_LANES; i++) {
+        lanes[i].array[0] = s0[i];
+        lanes[i].array[1] = s1[i];
+        scores[i] = result[i];
+    }
+}
+
+#else
+
+/* Scalar fallback, with the same results as the vector code */
+static void rollout_lanes(struct state_array *lanes,
+                          const board_t *board,
+                          char player,
+                          fixed_point_t *scores)
+{
+    for (int i = 0; i < ROLLOUT_LANES; i++)
+        scores[i] = rollout(&lanes[i], board, player);
+}
+
+#endif
+
+/* Lanes are seeded with two outputs of xoro each */
+void rollout_batch(struct state_array *xoro,
+                   const board_t *board,
+                   char player,
+                   fixed_point_t *scores)
+{
+    struct state_array lanes[ROLLOUT_LANES];
+
+    for (int i = 0; i < ROLLOUT_LANES; i++) {
+        lanes[i].array[0] = xoro_next(xoro);
+        lanes[i].array[1] = xoro_next(xoro);
+    }
+    rollout_lanes(lanes, board, player, scores);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../game.h"
+#include "xoroshiro.h"
+
+/* Play uniformly random moves from board, player to move first, until the
+ * game ends, and score the result for the opponent of player, who made the
+ * move leading to board.
+ */
+fixed_point_t rollout(struct state_array *xoro,
+                      const board_t *board,
+                      char player);
+
+/* rollout(), also storing the position the playout ended in into *final */
+fixed_point_t rollout_final(struct state_array *xoro,
+                            const board_t *board,
+                            char player,
+                            board_t *final);
+
+/* Number of playouts run together by rollout_batch() */
+#define ROLLOUT_LANES 16
+
+/* Run ROLLOUT_LANES playouts from board and store their scores in scores[].
+ * Every playout draws from its own generator, seeded from xoro, and gives
+ * exactly the score rollout() would with that generator.
+ */
+void rollout_batch(struct state_array *xoro,
+                   const board_t *board,
+                   char player,
+                   fixed_point_t *scores);
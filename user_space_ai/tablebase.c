@@ -0,0 +1,109 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tablebase.h"
+
+static void *map;
+static size_t map_size;
+static const uint32_t *slots;
+static uint32_t slot_mask;
+static int slot_bits;
+
+/* Check that data holds a tablebase for this board and goal, and serve
+ * probes from it.
+ */
+static int tablebase_attach(const void *data, size_t size)
+{
+    const struct tablebase_header *hdr = data;
+
+    if (size < sizeof(*hdr) || hdr->magic != TABLEBASE_MAGIC ||
+        hdr->board_size != BOARD_SIZE || hdr->goal != GOAL ||
+        hdr->slot_bits < 1 || hdr->slot_bits > 31 ||
+        hdr->n_positions >= 1U << hdr->slot_bits ||
+        size != sizeof(*hdr) + (sizeof(uint32_t) << hdr->slot_bits))
+        return -1;
+
+    slots = (const uint32_t *) (hdr + 1);
+    slot_bits = hdr->slot_bits;
+    slot_mask = (1U << slot_bits) - 1;
+    return 0;
+}
+
+int tablebase_probe(const board_t *board, char player, int *value)
+{
+    int n_o = popcount16(board->mask[0]), n_x = popcount16(board->mask[1]);
+    board_t canon;
+
+    /* Only positions with 'O' moving first were solved */
+    if (!slots || PLAYER_ID(player) != (n_o != n_x))
+        return -1;
+
+    int t = board_canonical(board, &canon);
+    uint32_t index = tablebase_index(&canon);
+    uint32_t h = tablebase_hash(index, slot_bits);
+
+    /* A damaged file may have no empty slot left, or hold moves that do not
+     * fit the position: never probe more than all the slots, and only
+     * return a move to an empty grid
+     */
+    for (uint32_t n = 0; n <= slot_mask; n++, h = (h + 1) & slot_mask) {
+        uint32_t slot = slots[h];
+        if (!slot)
+            return -1;
+        if (slot >> TABLEBASE_INDEX_SHIFT == index) {
+            int move = slot & TABLEBASE_MOVE_MASK;
+            if (move >= N_GRIDS)
+                return -1;
+            move = sym_grid[sym_inverse[t]][move];
+            if (!(board_empty(board) & (1U << move)))
+                return -1;
+            if (value)
+                *value = (slot >> TABLEBASE_VALUE_SHIFT) & TABLEBASE_VALUE_MASK;
+            return move;
+        }
+    }
+    return -1;
+}
+
+int tablebase_load(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        map = NULL;
+        return -1;
+    }
+    map_size = st.st_size;
+
+    if (tablebase_attach(map, map_size) < 0) {
+        fprintf(stderr, "[tablebase] %s: not a tablebase for this board\n",
+                path);
+        tablebase_unload();
+        return -1;
+    }
+    return 0;
+}
+
+void tablebase_unload(void)
+{
+    slots = NULL;
+    if (map)
+        munmap(map, map_size);
+    map = NULL;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "../game.h"
+
+/* File the tablebase is loaded from by default */
+#define TABLEBASE_FILE "kxo.tb"
+#define TABLEBASE_MAGIC 0x4254584bU /* "KXTB" */
+
+/* Perfect-play values, seen from the player to move */
+enum {
+    TABLEBASE_WIN = 1,
+    TABLEBASE_DRAW,
+    TABLEBASE_LOSS,
+};
+
+/* The file is this header followed by 1 << slot_bits slots, all in host
+ * byte order. It holds every non-terminal position reachable from the empty
+ * board with 'O' moving first, one per class of symmetric positions.
+ */
+struct tablebase_header {
+    uint32_t magic;
+    uint8_t board_size;
+    uint8_t goal;
+    uint8_t slot_bits;
+    uint8_t reserved;
+    uint32_t n_positions;
+};
+
+/* A slot packs the base-3 index of a canonical position (see
+ * board_canonical(); digit i is 0, 1 or 2 for an empty grid i, 'O' or 'X')
+ * into its upper 26 bits, which hold any index up to 3^16, then the value
+ * in 2 bits and the best move, in the frame of the canonical position, in
+ * 4 bits. Value 0 is never used, so an empty slot reads 0. Positions are
+ * placed by linear probing from tablebase_hash(index).
+ */
+#define TABLEBASE_VALUE_SHIFT 4
+#define TABLEBASE_INDEX_SHIFT 6
+#define TABLEBASE_MOVE_MASK ((1U << TABLEBASE_VALUE_SHIFT) - 1)
+#define TABLEBASE_VALUE_MASK 3U
+
+#define TABLEBASE_SLOT(index, value, move)         \
+    ((uint32_t) (index) << TABLEBASE_INDEX_SHIFT | \
+     (uint32_t) (value) << TABLEBASE_VALUE_SHIFT | (uint32_t) (move))
+
+static inline uint32_t tablebase_index(const board_t *board)
+{
+    static const uint32_t pow3[16] = {
+        1,     3,     9,      27,     81,     243,     729,     2187,
+        6561,  19683, 59049,  177147, 531441, 1594323, 4782969, 14348907,
+    };
+    uint32_t index = 0;
+
+    for_each_bit(i, board->mask[0])
+        index += pow3[i];
+    for_each_bit(i, board->mask[1])
+        index += 2 * pow3[i];
+    return index;
+}
+
+static inline uint32_t tablebase_hash(uint32_t index, int slot_bits)
+{
+    return (index * 0x9e3779b1U) >> (32 - slot_bits);
+}
+
+/* Best move for player on board and its value through *value, or -1 when
+ * no tablebase is loaded or it does not hold the position.
+ */
+int tablebase_probe(const board_t *board, char player, int *value);
+
+int tablebase_load(const char *path);
+void tablebase_unload(void);
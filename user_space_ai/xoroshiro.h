@@ -11,3 +11,4 @@ struct state_array {
 u64 xoro_next(struct state_array *obj);
 void xoro_jump(struct state_array *obj);
 void xoro_init(struct state_array *obj);
+void xoro_init_stream(struct state_array *obj, int stream);
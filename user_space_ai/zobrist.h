@@ -1,21 +1,87 @@
 #pragma once
 
-#include <user_list.h>
+#include <stdint.h>
 
 #include "../game.h"
+#include "xoroshiro.h" /* u64 */
 
-#define HASH_TABLE_SIZE (100003)
+/* Default size of the negamax transposition table in KiB */
+#define ZOBRIST_TT_KB 1024
 
 extern u64 zobrist_table[N_GRIDS][2];
 
+/* XORed into the key of a position with 'X' to move. Which side moves first
+ * alternates between games, so the stones alone do not tell it.
+ */
+extern u64 zobrist_side;
+
+/* How the score of an entry bounds the true score of its position */
+enum {
+    ZOBRIST_EXACT,
+    ZOBRIST_LOWER, /* failed high: score <= true score */
+    ZOBRIST_UPPER, /* failed low: true score <= score */
+};
+
+/* A search result, searched depth plies deep during generation age. Scores
+ * fit in 16 bits, and depth 0 marks an empty entry as positions are only
+ * stored after searching at least one ply. The fields share one word so
+ * that they are read and written at once.
+ */
+typedef union {
+    struct {
+        int16_t score;
+        int8_t move;
+        uint8_t depth;
+        uint8_t bound;
+        uint8_t age;
+    };
+    u64 word;
+} zobrist_data_t;
+
+/* The result for the position with Zobrist key check ^ data.word. Searches
+ * running in parallel read and write entries without locks: when two
+ * writers race on an entry and leave the words of different results, the
+ * key no longer checks out and the entry reads as empty.
+ */
 typedef struct {
-    u64 key;
-    int score;
-    int move;
-    struct hlist_node ht_list;
+    u64 check;
+    zobrist_data_t data;
 } zobrist_entry_t;
 
-void zobrist_init(void);
-zobrist_entry_t *zobrist_get(u64 key);
-void zobrist_put(u64 key, int score, int move);
+/* Entries are grouped in buckets of 64 bytes, aligned to their size, so a
+ * probe touches a single cache line of 64 bytes or more. The last entry of
+ * a bucket is always replaced by a new position, the others only by results
+ * at least as deep as theirs or when they are left from an earlier
+ * generation.
+ */
+#define ZOBRIST_BUCKET_BYTES 64
+#define ZOBRIST_BUCKET_ENTRIES (ZOBRIST_BUCKET_BYTES / sizeof(zobrist_entry_t))
+
+typedef struct {
+    zobrist_entry_t entry[ZOBRIST_BUCKET_ENTRIES];
+} __attribute__((aligned(ZOBRIST_BUCKET_BYTES))) zobrist_bucket_t;
+
+/* Zobrist key of a whole position */
+static inline u64 zobrist_key(const board_t *board)
+{
+    u64 key = 0;
+    for (int p = 0; p < 2; p++) {
+        for_each_bit(i, board->mask[p])
+            key ^= zobrist_table[i][p];
+    }
+    return key;
+}
+
+/* Draw the keys from a sequence started at seed, or at a value taken from
+ * the clock when seed is 0
+ */
+void zobrist_init(u64 seed);
+int zobrist_tt_init(unsigned int size_kb);
+void zobrist_tt_exit(void);
+int zobrist_get(u64 key, zobrist_data_t *data);
+void zobrist_put(u64 key, int depth, int bound, int score, int move);
+
+/* Start a new generation: the entries stored so far still answer probes,
+ * as the value of a position does not change, but give way to any new one.
+ */
 void zobrist_clear(void);
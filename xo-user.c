@@ -11,6 +11,9 @@
 
 #include "./user_space_ai/mcts.h"
 #include "./user_space_ai/negamax.h"
+#include "./user_space_ai/tablebase.h"
+#include "./user_space_ai/zobrist.h"
+#include "book.h"
 #include "coro.h"
 #include "game.h"
 
@@ -37,6 +40,12 @@ static int num_games = 0;
 static int capacity = 0;
 static time_t start_time;
 
+/* With -b the user-space MCTS scores each leaf with a batch of
+ * ROLLOUT_LANES playouts. Its budget counts playouts, so that makes as many
+ * times fewer descents per move: faster playouts for a shallower tree.
+ */
+static int leaf_batch;
+
 static void display_time()
 {
     time_t now = time(NULL);
@@ -192,15 +201,24 @@ static void listen_keyboard_handler(void)
     close(attr_fd);
 }
 
-static void decompress_table(uint32_t bits, char *table)
+/* Gather every other bit of a 32-bit word into a 16-bit mask */
+static inline uint16_t compact_bits(uint32_t bits)
 {
-    for (int i = 0; i < N_GRIDS; i++) {
-        uint32_t v = (bits >> (i * 2)) & 0x3;
-        table[i] = (v == 0) ? ' ' : (v == 1) ? 'O' : 'X';
-    }
+    bits &= 0x55555555;
+    bits = (bits | (bits >> 1)) & 0x33333333;
+    bits = (bits | (bits >> 2)) & 0x0F0F0F0F;
+    bits = (bits | (bits >> 4)) & 0x00FF00FF;
+    bits = (bits | (bits >> 8)) & 0x0000FFFF;
+    return bits;
+}
+
+static void decompress_table(uint32_t bits, board_t *board)
+{
+    board->mask[0] = compact_bits(bits);
+    board->mask[1] = compact_bits(bits >> 1);
 }
 
-static int draw_board(char *table)
+static int draw_board(const board_t *board)
 {
     int i = 0, k = 0;
     draw_buffer[i++] = '\n';
@@ -208,7 +226,7 @@ static int draw_board(char *table)
 
     while (i < DRAWBUFFER_SIZE) {
         for (int j = 0; j < (BOARD_SIZE << 1) - 1 && k < N_GRIDS; j++) {
-            draw_buffer[i++] = j & 1 ? '|' : table[k++];
+            draw_buffer[i++] = j & 1 ? '|' : board_get(board, k++);
         }
         draw_buffer[i++] = '\n';
         for (int j = 0; j < (BOARD_SIZE << 1) - 1; j++) {
@@ -234,7 +252,7 @@ static void run_kernel_mode(void)
     int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
 
-    char table_buf[DRAWBUFFER_SIZE];
+    board_t board_buf;
 
     fd_set readset;
     int device_fd = open(XO_DEVICE_FILE, O_RDONLY);
@@ -260,8 +278,8 @@ static void run_kernel_mode(void)
             FD_CLR(device_fd, &readset);
             printf("\033[H\033[J"); /* ASCII escape code to clear the screen */
             read(device_fd, &frame, sizeof(frame));
-            decompress_table(frame.compressed_table, table_buf);
-            draw_board(table_buf);
+            decompress_table(frame.compressed_table, &board_buf);
+            draw_board(&board_buf);
             printf("%s", draw_buffer);
             display_time();
             log_move(frame.last_move);
@@ -277,7 +295,7 @@ static void run_kernel_mode(void)
 static char turn;
 static int finish;
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
-static char table[N_GRIDS];
+static board_t board;
 
 static void check_win_work_func(void *arg)
 {
@@ -300,11 +318,11 @@ static void check_win_work_func(void *arg)
         return;
     }
     for (;;) {
-        if (check_win(table) != ' ') {
-            draw_board(table);
+        if (check_win(&board) != ' ') {
+            draw_board(&board);
             printf("\033[H\033[J");
             printf("%s", draw_buffer);
-            memset(table, ' ', N_GRIDS);
+            board_init(&board);
         }
 
         if (setjmp(task->env) == 0) {
@@ -338,7 +356,7 @@ static void drawboard_work_func(void *arg)
 
     for (;;) {
         if (finish) {
-            draw_board(table);
+            draw_board(&board);
             printf("\033[H\033[J");
             printf("%s", draw_buffer);
             finish = 0;
@@ -375,9 +393,13 @@ static void ai_one_work_func(void *arg)
 
     for (;;) {
         if (turn == 'O') {
-            int move = mcts(table, 'O');
+            int move = book_probe(&board, 'O');
+            if (move == -1)
+                move = tablebase_probe(&board, 'O', NULL);
+            if (move == -1)
+                move = mcts(&board, 'O', 0, NULL);
             if (move != -1)
-                table[move] = 'O';
+                board_play(&board, move, 'O');
 
             turn = 'X';
         }
@@ -414,11 +436,14 @@ static void ai_two_work_func(void *arg)
 
     for (;;) {
         if (turn == 'X') {
-            int move;
-            move = negamax_predict(table, 'X').move;
+            int move = book_probe(&board, 'X');
+            if (move == -1)
+                move = tablebase_probe(&board, 'X', NULL);
+            if (move == -1)
+                move = negamax_predict(&board, 'X').move;
 
             if (move != -1)
-                table[move] = 'X';
+                board_play(&board, move, 'X');
 
             turn = 'O';
         }
@@ -511,9 +536,11 @@ static void co_listen_keyboard_handler(void *arg)
 
 static void run_user_mode(void)
 {
-    negamax_init();
-    mcts_init();
-    memset(table, ' ', N_GRIDS);
+    game_init();
+    if (negamax_init(ZOBRIST_TT_KB, 0) < 0 ||
+        mcts_init(MCTS_ARENA_SIZE, leaf_batch) < 0)
+        exit(1);
+    board_init(&board);
     turn = 'O';
     finish = 1;
 
@@ -536,18 +563,33 @@ static void run_user_mode(void)
 
 int main(int argc, char *argv[])
 {
-    enum Mode { MODE_KERNEL, MODE_USER };
+    enum Mode { MODE_KERNEL, MODE_USER, MODE_TABLEBASE };
     enum Mode mode = MODE_KERNEL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b")) != -1) {
+        if (opt != 'b') {
+            fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+            return 1;
+        }
+        leaf_batch = 1;
+    }
 
     printf("Select AI mode:\n");
     printf("1. Kernel AI (current default)\n");
     printf("2. User-space AI (coroutine)\n");
-    printf("Enter choice (1/2): ");
+    printf("3. User-space AI (tablebase from " TABLEBASE_FILE ")\n");
+    printf("Enter choice (1/2/3): ");
     fflush(stdout);
 
     int choice = getchar();
     if (choice == '2') {
         mode = MODE_USER;
+    } else if (choice == '3') {
+        /* Positions missing from the tablebase are still searched */
+        if (tablebase_load(TABLEBASE_FILE) < 0)
+            exit(1);
+        mode = MODE_TABLEBASE;
     }
 
     start_time = time(NULL);
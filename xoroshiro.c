@@ -49,3 +49,14 @@ void xoro_init(struct state_array *obj)
 {
     seed(obj, 314159265, 1618033989);
 }
+
+/* Seed generator number stream of a set of independent generators: stream
+ * k starts k jumps, i.e. k * 2^64 outputs, after the default seed, so the
+ * streams never overlap.
+ */
+void xoro_init_stream(struct state_array *obj, int stream)
+{
+    xoro_init(obj);
+    while (stream-- > 0)
+        xoro_jump(obj);
+}
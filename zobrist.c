@@ -1,12 +1,16 @@
-#include <linux/slab.h>
+#include <linux/compiler.h>
+#include <linux/ktime.h>
+#include <linux/overflow.h>
+#include <linux/vmalloc.h>
 
 #include "zobrist.h"
 
 u64 zobrist_table[N_GRIDS][2];
+u64 zobrist_side;
 
-#define HASH(key) ((key) % HASH_TABLE_SIZE)
-
-static struct hlist_head *hash_table;
+static zobrist_bucket_t *hash_table;
+static u64 hash_mask;
+static uint8_t generation;
 
 /* See https://github.com/wangyi-fudan/wyhash
  */
@@ -21,64 +25,127 @@ static inline u64 wyhash64_stateless(u64 *seed)
     return m2;
 }
 
-static u64 wyhash64(void)
+void zobrist_init(u64 seed)
 {
-    u64 seed = (u64) ktime_to_ns(ktime_get());
-    return wyhash64_stateless(&seed);
+    if (!seed)
+        seed = (u64) ktime_to_ns(ktime_get());
+    for (int i = 0; i < N_GRIDS; i++) {
+        zobrist_table[i][0] = wyhash64_stateless(&seed);
+        zobrist_table[i][1] = wyhash64_stateless(&seed);
+    }
+    zobrist_side = wyhash64_stateless(&seed);
 }
 
-void zobrist_init(void)
+/* Allocate the transposition table with the largest power-of-2 number of
+ * buckets that fits in size_kb KiB.
+ */
+int zobrist_tt_init(unsigned int size_kb)
 {
-    int i;
-    for (i = 0; i < N_GRIDS; i++) {
-        zobrist_table[i][0] = wyhash64();
-        zobrist_table[i][1] = wyhash64();
-    }
-    hash_table =
-        kmalloc(sizeof(struct hlist_head) * HASH_TABLE_SIZE, GFP_KERNEL);
+    u64 n_buckets = 1;
+
+    while (n_buckets * 2 * sizeof(zobrist_bucket_t) <= size_kb * 1024ULL)
+        n_buckets *= 2;
+    hash_table = vzalloc(array_size(n_buckets, sizeof(zobrist_bucket_t)));
     if (!hash_table) {
         pr_info("kxo: Failed to allocate space for hash_table\n");
-        return;
+        return -ENOMEM;
     }
-    for (i = 0; i < HASH_TABLE_SIZE; i++)
-        INIT_HLIST_HEAD(&hash_table[i]);
+    hash_mask = n_buckets - 1;
+    return 0;
 }
 
-zobrist_entry_t *zobrist_get(u64 key)
+void zobrist_tt_exit(void)
 {
-    unsigned long long hash_key = HASH(key);
+    vfree(hash_table);
+    hash_table = NULL;
+}
 
-    if (hlist_empty(&hash_table[hash_key]))
-        return NULL;
+/* Whether entry holds the result for key, which is read into *data */
+static inline int entry_read(const zobrist_entry_t *entry,
+                             u64 key,
+                             zobrist_data_t *data)
+{
+    data->word = READ_ONCE(entry->data.word);
+    return (READ_ONCE(entry->check) ^ data->word) == key && data->depth;
+}
 
-    zobrist_entry_t *entry = NULL;
+static inline void entry_write(zobrist_entry_t *entry,
+                               u64 key,
+                               zobrist_data_t data)
+{
+    WRITE_ONCE(entry->check, key ^ data.word);
+    WRITE_ONCE(entry->data.word, data.word);
+}
+
+/* Store the result for key in *data, returning whether there is one */
+int zobrist_get(u64 key, zobrist_data_t *data)
+{
+    const zobrist_entry_t *entry = hash_table[key & hash_mask].entry;
 
-    hlist_for_each_entry(entry, &hash_table[hash_key], ht_list) {
-        if (entry->key == key)
-            return entry;
+    for (int i = 0; i < ZOBRIST_BUCKET_ENTRIES; i++, entry++) {
+        if (entry_read(entry, key, data))
+            return 1;
     }
-    return NULL;
+    return 0;
 }
 
-void zobrist_put(u64 key, int score, int move)
+/* Depth of an entry as far as replacement goes */
+static inline int entry_depth(const zobrist_entry_t *entry)
 {
-    unsigned long long hash_key = HASH(key);
-    zobrist_entry_t *new_entry = kmalloc(sizeof(zobrist_entry_t), GFP_KERNEL);
-    new_entry->key = key;
-    new_entry->move = move;
-    new_entry->score = score;
-    hlist_add_head(&new_entry->ht_list, &hash_table[hash_key]);
+    zobrist_data_t data = {.word = READ_ONCE(entry->data.word)};
+    return data.age == READ_ONCE(generation) ? data.depth : 0;
 }
 
-void zobrist_clear(void)
+void zobrist_put(u64 key, int depth, int bound, int score, int move)
 {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        while (!hlist_empty(&hash_table[i])) {
-            zobrist_entry_t *entry =
-                hlist_entry(hash_table[i].first, zobrist_entry_t, ht_list);
-            hlist_del(&entry->ht_list);
-            kfree(entry);
+    zobrist_entry_t *bucket = hash_table[key & hash_mask].entry;
+    zobrist_entry_t *entry = NULL;
+    zobrist_data_t data = {.word = 0};
+
+    /* A position already stored is updated in place, unless by a shallower
+     * result, in which case the deeper one is kept for this generation
+     */
+    for (int i = 0; i < ZOBRIST_BUCKET_ENTRIES; i++) {
+        if (entry_read(&bucket[i], key, &data)) {
+            if (depth < data.depth) {
+                data.age = READ_ONCE(generation);
+                entry_write(&bucket[i], key, data);
+                return;
+            }
+            entry = &bucket[i];
+            break;
+        }
+    }
+
+    /* Otherwise it takes the shallowest depth-preferred entry if it is at
+     * least as deep, and the always-replace entry if not. Entries of earlier
+     * generations count as empty.
+     */
+    if (!entry) {
+        entry = &bucket[0];
+        for (int i = 1; i < ZOBRIST_BUCKET_ENTRIES - 1; i++) {
+            if (entry_depth(&bucket[i]) < entry_depth(entry))
+                entry = &bucket[i];
         }
-        INIT_HLIST_HEAD(&hash_table[i]);
+        if (depth < entry_depth(entry))
+            entry = &bucket[ZOBRIST_BUCKET_ENTRIES - 1];
     }
+
+    data.word = 0;
+    data.score = score;
+    data.move = move;
+    data.depth = depth;
+    data.bound = bound;
+    data.age = READ_ONCE(generation);
+    entry_write(entry, key, data);
+}
+
+/* The generation is kept in 8 bits and wraps after 256 searches, after
+ * which entries left from 256 searches ago count as current again when
+ * choosing what to replace. Probes accept entries of any generation, so
+ * this only delays their replacement.
+ */
+void zobrist_clear(void)
+{
+    WRITE_ONCE(generation, generation + 1);
 }